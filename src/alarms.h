@@ -0,0 +1,239 @@
+// Alarms
+// Rings the alarms from loop(), one at a time, and logs how each dose went once it is answered.
+// Pure logic so that it also builds on the host, where tools/replay.cpp runs it on a trace: include it
+// once, after the PB_* button pins and inputs.h and before menu.h. The includer provides the outputs
+// and storage declared below.
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include "dose_log.h"
+#include "power.h"
+
+// Alarm configuration
+// Add initial values here when changing the number of alarms; the menu picks them up from n_alarms
+bool alarm_enabled = true;
+constexpr int n_alarms = 3;
+// centred number for easy choose
+int alarm_hours[n_alarms] = {12, 12, 12};
+int alarm_minutes[n_alarms] = {27, 27, 27};
+bool alarm_triggered[n_alarms] = {false, false, false};
+int triggered_day = -1; // Day alarm_triggered is for, kept in flash with it
+
+// Time of day read at the last clock update
+int hours = 0;
+int minutes = 0;
+int seconds = 0;
+
+// Doses, see dose_log.h
+#define DOSE_RING_TIMEOUT_MS 300000UL // An alarm nobody acknowledges counts as missed after this long
+#define DOSE_SNOOZE_S 600
+#define DOSE_MAX_SNOOZES 3
+uint32_t dose_scheduled[n_alarms];        // Epoch of the dose each alarm is ringing for
+unsigned long snooze_until[n_alarms] = {}; // Epoch to ring a snoozed alarm again, 0 if not snoozed
+int snooze_count[n_alarms] = {};
+
+// Alarm being rung, in loop() so that the rest of the box keeps running
+#define RING_NOTE_MS 500
+int ringing = -1; // Alarm ringing, -1 if none
+int ring_note = 0;
+unsigned long ring_start_ms = 0;
+unsigned long ring_note_ms = 0;
+DoseRecord ring_record;
+
+// Musical notes for the buzzer
+int n_notes = 8;
+int C = 262;
+int D = 294;
+int E = 330;
+int F = 349;
+int G = 392;
+int A = 440;
+int B = 494;
+int C_H = 523;
+int notes[] = {C, D, E, F, G, A, B, C_H};
+
+// Provided by the includer
+unsigned long inputMillis();
+int64_t inputClockMs(int clock);
+bool inputLocalTime(struct tm *info);
+void close_menu();
+void show_ring(bool on);       // The alarm on the display and LED, or cleared away
+void play_note(int frequency); // 0 for silence
+void logDose(DoseRecord &record); // Assigns its sequence number
+void publishAdherence(time_t from, time_t to);
+void saveAlarms();
+void saveTriggered();
+
+// Function to update the time
+void update_time()
+{
+    struct tm timeinfo;
+    inputLocalTime(&timeinfo);
+
+    hours = timeinfo.tm_hour;
+    minutes = timeinfo.tm_min;
+    seconds = timeinfo.tm_sec;
+}
+
+// Function to start ringing an alarm, ring_step() does the rest
+void start_ring(int alarm)
+{
+    // The alarm takes over the display and buttons from the menu
+    close_menu();
+    ringing = alarm;
+    ring_record = {};
+    ring_record.scheduled = dose_scheduled[alarm];
+    ring_record.ringStart = inputClockMs(CLOCK_LOCAL) / 1000;
+    ring_record.alarm = alarm;
+    ring_start_ms = inputMillis();
+    ring_note_ms = ring_start_ms;
+    ring_note = 0;
+
+    show_ring(true);
+    play_note(notes[ring_note]);
+}
+
+// Function to play the ringing alarm and log how its dose went once it is answered
+// CANCEL takes the dose and UP snoozes it, if allowed; nobody answering for long enough misses it
+void ring_step(int pressed)
+{
+    unsigned long now = inputMillis();
+    DoseOutcome outcome;
+    if (pressed == PB_CANCEL)
+    {
+        outcome = DOSE_TAKEN;
+    }
+    else if (pressed == PB_UP && snooze_count[ringing] < DOSE_MAX_SNOOZES)
+    {
+        outcome = DOSE_SNOOZED;
+    }
+    else if (now - ring_start_ms >= DOSE_RING_TIMEOUT_MS)
+    {
+        outcome = DOSE_MISSED;
+    }
+    else
+    {
+        // Ring the buzzer
+        if (now - ring_note_ms >= RING_NOTE_MS)
+        {
+            ring_note = (ring_note + 1) % n_notes;
+            ring_note_ms = now;
+            play_note(notes[ring_note]);
+        }
+        return;
+    }
+
+    play_note(0);
+    show_ring(false);
+
+    ring_record.outcome = outcome;
+    unsigned long latency = (now - ring_start_ms) / 1000;
+    ring_record.latency = latency < 0xFFFFUL ? latency : 0xFFFFUL;
+    if (outcome == DOSE_SNOOZED)
+    {
+        snooze_count[ringing]++;
+        snooze_until[ringing] = ring_record.ringStart + ring_record.latency + DOSE_SNOOZE_S;
+    }
+    ringing = -1;
+
+    logDose(ring_record);
+}
+
+// Time until ring_step() has something to do: the next note, or missing the dose
+unsigned long ring_left(unsigned long now)
+{
+    unsigned long note = periodLeft(now, ring_note_ms, RING_NOTE_MS);
+    unsigned long timeout = periodLeft(now, ring_start_ms, DOSE_RING_TIMEOUT_MS);
+    return note < timeout ? note : timeout;
+}
+
+// Epoch of the last midnight on the local clock
+time_t local_midnight()
+{
+    struct tm timeinfo;
+    inputLocalTime(&timeinfo);
+    return inputClockMs(CLOCK_LOCAL) / 1000 - (timeinfo.tm_hour * 60L + timeinfo.tm_min) * 60 - timeinfo.tm_sec;
+}
+
+// Publish the adherence of the day that just ended, at midnight, and rearm the alarms
+void doseCheckDay()
+{
+    static int day = -1;
+    struct tm timeinfo;
+    if (!inputLocalTime(&timeinfo))
+    {
+        return; // The clock is not set yet
+    }
+    int today = timeinfo.tm_year * 366 + timeinfo.tm_yday;
+
+    if (day != -1 && day != today)
+    {
+        time_t midnight = local_midnight();
+        publishAdherence(midnight - 24 * 60 * 60, midnight);
+    }
+    day = today;
+
+    // Every alarm rings again on a new day, the ones rung before a reset today stay rung
+    if (triggered_day != today)
+    {
+        for (int i = 0; i < n_alarms; i++)
+        {
+            alarm_triggered[i] = false;
+        }
+        triggered_day = today;
+        saveTriggered();
+    }
+}
+
+// Function to ring the alarms that are due, after a clock update
+void check_alarms()
+{
+    doseCheckDay();
+
+    // One alarm rings at a time
+    if (alarm_enabled == true && ringing < 0)
+    {
+        for (int i = 0; i < n_alarms && ringing < 0; i++)
+        {
+            if (alarm_triggered[i] == false && alarm_hours[i] == hours && alarm_minutes[i] == minutes)
+            {
+                dose_scheduled[i] = inputClockMs(CLOCK_LOCAL) / 1000 - seconds;
+                snooze_count[i] = 0;
+                alarm_triggered[i] = true;
+                saveTriggered();
+                start_ring(i);
+            }
+            else if (snooze_until[i] != 0 && (unsigned long)(inputClockMs(CLOCK_LOCAL) / 1000) >= snooze_until[i])
+            {
+                snooze_until[i] = 0;
+                start_ring(i);
+            }
+        }
+    }
+}
+
+// Load and commit callbacks for the alarm menu items
+void load_alarm(int index, int *values)
+{
+    values[0] = alarm_hours[index];
+    values[1] = alarm_minutes[index];
+}
+
+void commit_alarm(int index, const int *values)
+{
+    alarm_hours[index] = values[0];
+    alarm_minutes[index] = values[1];
+    alarm_triggered[index] = false;
+    snooze_until[index] = 0;
+    alarm_enabled = true;
+    saveAlarms();
+    saveTriggered();
+}
+
+void commit_disable_alarms(int index, const int *values)
+{
+    alarm_enabled = false;
+    saveAlarms();
+}
@@ -0,0 +1,329 @@
+// Dose log
+// Every ring of an alarm ends in a fixed size record, appended to flash.
+// The storage is a ring of sectors: the oldest sector is erased when the newest one is full,
+// so all sectors wear evenly, and a record torn by a power loss only fails its CRC.
+// The first sector only holds DOSE_MAGIC, written once the rest is erased: storage without it may hold
+// anything (the doselog partition used to be part of the file system), so it is erased before use.
+// The storage sits behind DoseStorage (the doselog partition, or a file when there is none),
+// so the log also runs on the host.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DOSE_SECTOR_SIZE 4096
+#define DOSE_MAX_SECTORS 16
+#define DOSE_SYNC_BATCH 16
+#define DOSE_EMPTY 0xFFFFFFFF // Sequence number of an erased slot
+#define DOSE_MAGIC "MBD1"
+
+enum DoseOutcome
+{
+    DOSE_TAKEN,
+    DOSE_SNOOZED,
+    DOSE_MISSED,
+};
+
+struct DoseRecord
+{
+    uint32_t seq;       // Increases by one with every record
+    uint32_t scheduled; // Epoch of the dose, the same for all the rings of a snoozed alarm
+    uint32_t ringStart; // Epoch the alarm started ringing
+    uint16_t latency;   // Seconds until the alarm was acknowledged
+    uint8_t alarm : 4;
+    uint8_t outcome : 4;
+    uint8_t crc; // CRC-8 of the bytes above
+};
+static_assert(sizeof(DoseRecord) == 16, "dose records are stored as is");
+
+constexpr int DOSE_RECORDS_PER_SECTOR = DOSE_SECTOR_SIZE / sizeof(DoseRecord);
+
+// Flash-like storage: erasing sets bytes to 0xFF, and writes are only made to erased bytes
+class DoseStorage
+{
+public:
+    virtual size_t size() = 0;
+    virtual bool read(size_t offset, void *buf, size_t size) = 0;
+    virtual bool write(size_t offset, const void *buf, size_t size) = 0;
+    virtual bool erase(size_t offset, size_t size) = 0;
+};
+
+inline uint8_t doseCrc(const DoseRecord &record)
+{
+    const uint8_t *bytes = (const uint8_t *)&record;
+    uint8_t crc = 0;
+    for (size_t i = 0; i < offsetof(DoseRecord, crc); i++)
+    {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+inline bool doseValid(const DoseRecord &record)
+{
+    return record.seq != DOSE_EMPTY && record.crc == doseCrc(record);
+}
+
+inline bool doseErased(const DoseRecord &record)
+{
+    const uint8_t *bytes = (const uint8_t *)&record;
+    for (size_t i = 0; i < sizeof(record); i++)
+    {
+        if (bytes[i] != 0xFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+class DoseLog
+{
+public:
+    // Find the end of the log and rebuild the sector index, erasing the storage first if it is not a log
+    // The head is after the last slot written to in the sector holding the newest record,
+    // so appending after a power loss never reuses a slot that may be half written
+    bool begin(DoseStorage *storage)
+    {
+        this->storage = storage;
+        sectors = (int)(storage->size() / DOSE_SECTOR_SIZE) - 1;
+        sectors = sectors < DOSE_MAX_SECTORS ? sectors : DOSE_MAX_SECTORS;
+        if (sectors < 2 || (!formatted() && !format()))
+        {
+            this->storage = nullptr;
+            return false;
+        }
+
+        bool found = false;
+        uint32_t newest = 0;
+        int used[DOSE_MAX_SECTORS];
+        for (int sector = 0; sector < sectors; sector++)
+        {
+            sectorSeq[sector] = DOSE_EMPTY;
+            used[sector] = 0;
+            for (int slot = 0; slot < DOSE_RECORDS_PER_SECTOR; slot++)
+            {
+                DoseRecord record;
+                if (!read(sector, slot, record))
+                {
+                    continue;
+                }
+                if (!doseErased(record))
+                {
+                    used[sector] = slot + 1;
+                }
+                if (!doseValid(record))
+                {
+                    continue;
+                }
+                if (sectorSeq[sector] == DOSE_EMPTY)
+                {
+                    sectorSeq[sector] = record.seq;
+                }
+                if (!found || record.seq > newest)
+                {
+                    found = true;
+                    newest = record.seq;
+                    headSector = sector;
+                }
+            }
+        }
+
+        if (found)
+        {
+            headSlot = used[headSector];
+            nextSeq = newest + 1;
+        }
+        else
+        {
+            // Start with a freshly erased first sector
+            headSector = sectors - 1;
+            headSlot = DOSE_RECORDS_PER_SECTOR;
+            nextSeq = 0;
+        }
+        return true;
+    }
+
+    bool available() const
+    {
+        return storage != nullptr;
+    }
+
+    // Sequence number the next record gets
+    uint32_t next() const
+    {
+        return nextSeq;
+    }
+
+    // Append a record, filling in its sequence number and CRC
+    // Returns false if it could not be stored, the record is still numbered so it can be published
+    bool append(DoseRecord &record)
+    {
+        record.seq = nextSeq++;
+        record.crc = doseCrc(record);
+        if (storage == nullptr)
+        {
+            return false;
+        }
+
+        if (headSlot >= DOSE_RECORDS_PER_SECTOR)
+        {
+            // Move on to the oldest sector, dropping its records
+            int next = (headSector + 1) % sectors;
+            sectorSeq[next] = DOSE_EMPTY;
+            if (!storage->erase(offset(next, 0), DOSE_SECTOR_SIZE))
+            {
+                return false;
+            }
+            headSector = next;
+            headSlot = 0;
+        }
+
+        size_t at = offset(headSector, headSlot);
+        headSlot++; // Even on failure, the slot may be partly written
+        if (!storage->write(at, &record, sizeof(record)))
+        {
+            return false;
+        }
+        if (sectorSeq[headSector] == DOSE_EMPTY)
+        {
+            sectorSeq[headSector] = record.seq;
+        }
+        return true;
+    }
+
+    // Collect up to max records from seq cursor on, oldest first
+    int collect(uint32_t cursor, DoseRecord *records, int max)
+    {
+        if (storage == nullptr)
+        {
+            return 0;
+        }
+
+        int n = 0;
+        // The sector after the head is the oldest one, the head sector comes last
+        for (int k = 1; k <= sectors && n < max; k++)
+        {
+            int sector = (headSector + k) % sectors;
+            int next = (sector + 1) % sectors;
+            if (sectorSeq[sector] == DOSE_EMPTY ||
+                (k < sectors && sectorSeq[next] != DOSE_EMPTY && sectorSeq[next] <= cursor))
+            {
+                continue; // Empty, or only holds records before the cursor
+            }
+
+            int slots = sector == headSector ? headSlot : DOSE_RECORDS_PER_SECTOR;
+            for (int slot = 0; slot < slots && n < max; slot++)
+            {
+                DoseRecord record;
+                if (read(sector, slot, record) && doseValid(record) && record.seq >= cursor)
+                {
+                    records[n++] = record;
+                }
+            }
+        }
+        return n;
+    }
+
+private:
+    // The log sectors come after the one holding the magic
+    size_t offset(int sector, int slot)
+    {
+        return (sector + 1) * DOSE_SECTOR_SIZE + slot * sizeof(DoseRecord);
+    }
+
+    bool read(int sector, int slot, DoseRecord &record)
+    {
+        return storage->read(offset(sector, slot), &record, sizeof(record));
+    }
+
+    bool formatted()
+    {
+        char magic[4];
+        return storage->read(0, magic, 4) && memcmp(magic, DOSE_MAGIC, 4) == 0;
+    }
+
+    // Erase the storage, then mark it as a log, so a power loss in between leaves it to be erased again
+    bool format()
+    {
+        return storage->erase(0, offset(sectors, 0)) && storage->write(0, DOSE_MAGIC, 4);
+    }
+
+    DoseStorage *storage = nullptr;
+    int sectors = 0;
+    uint32_t sectorSeq[DOSE_MAX_SECTORS]; // First sequence number in each sector, to find cursors without a scan
+    int headSector = 0;
+    int headSlot = 0; // Next free slot in the head sector
+    uint32_t nextSeq = 0;
+};
+
+// Outcome of the doses scheduled over a period
+struct DoseSummary
+{
+    int taken = 0;
+    int missed = 0;
+    int snoozed = 0;
+    unsigned long latency = 0; // Total time to take the doses taken, in seconds
+};
+
+inline DoseSummary doseSummary(DoseLog &log, time_t from, time_t to)
+{
+    DoseSummary summary;
+    DoseRecord records[DOSE_SYNC_BATCH];
+    uint32_t cursor = 0;
+    int n;
+    do
+    {
+        n = log.collect(cursor, records, DOSE_SYNC_BATCH);
+        for (int i = 0; i < n; i++)
+        {
+            const DoseRecord &r = records[i];
+            cursor = r.seq + 1;
+            if (r.scheduled < from || r.scheduled >= to)
+            {
+                continue;
+            }
+            if (r.outcome == DOSE_TAKEN)
+            {
+                summary.taken++;
+                summary.latency += r.latency;
+            }
+            else if (r.outcome == DOSE_MISSED)
+            {
+                summary.missed++;
+            }
+            else
+            {
+                summary.snoozed++;
+            }
+        }
+    } while (n == DOSE_SYNC_BATCH);
+    return summary;
+}
+
+// {"day":"<date>","taken":..,"missed":..,"snoozed":..,"adherence":<%>,"latency":<s>}
+// Adherence is the share of doses taken, and null on a day without doses, latency the mean time to take them
+inline int formatAdherence(char *json, size_t size, const char *date, const DoseSummary &summary)
+{
+    int doses = summary.taken + summary.missed;
+    char adherence[8];
+    if (doses > 0)
+    {
+        snprintf(adherence, sizeof(adherence), "%d", summary.taken * 100 / doses);
+    }
+    else
+    {
+        strcpy(adherence, "null");
+    }
+    return snprintf(json, size,
+                    "{\"day\":\"%s\",\"taken\":%d,\"missed\":%d,\"snoozed\":%d,\"adherence\":%s,\"latency\":%lu}",
+                    date, summary.taken, summary.missed, summary.snoozed, adherence,
+                    summary.taken > 0 ? summary.latency / summary.taken : 0);
+}
@@ -0,0 +1,502 @@
+// Inputs
+// Everything read from the outside world goes through the input* functions, so it can be
+// recorded into a compact trace on the device and replayed by a MEDIBOX_REPLAY build, on the
+// board or on the host (see tools/replay.cpp).
+// A trace is "MBT1" followed by records of:
+//   varint ms since the previous record, kind byte, channel byte, zigzag varint value(s)
+// Pins and sensors are only recorded when their value changes, and clocks as their offset
+// from the trace time, so an idle day takes a few kilobytes.
+// Pure logic so that it also builds on the host: include it once, after HIGH and TempAndHumidity
+// are defined. The includer provides the trace file and the reads declared below.
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_MAGIC "MBT1"
+#define TRACE_BUFFER_SIZE 512
+#define TRACE_FLUSH_MS 10000          // Longest time a record stays in RAM
+#define TRACE_MAX_SIZE 131072         // Half the LittleFS partition, recording stops there
+#define TRACE_MAX_RECORD 320          // Longest record: a message with the longest command and payload
+#define TRACE_CLOCK_TOLERANCE_MS 1000 // Clock drift below this is not recorded
+#define TRACE_MAX_PINS 40
+#define TRACE_MAX_COMMAND 32
+#define TRACE_MAX_PAYLOAD 256
+#define DHT_UNKNOWN INT16_MAX
+#define DHT_NAN INT16_MIN
+#define CLOCK_LOCAL 0 // System time, set through configTime()
+#define CLOCK_NTP 1   // NTPClient time, used for the buzzer schedule
+
+enum TraceKind
+{
+    TRACE_DIGITAL, // channel: pin, value: level
+    TRACE_ANALOG,  // channel: pin, value: reading
+    TRACE_DHT,     // values: temperature and humidity x10
+    TRACE_CLOCK,   // channel: clock, value: epoch ms minus trace ms
+    TRACE_MESSAGE  // command and payload strings of an MQTT message
+};
+
+struct TraceRecord
+{
+    unsigned long at; // Trace time
+    uint8_t kind;
+    uint8_t channel;
+    int64_t value[2];
+    char command[TRACE_MAX_COMMAND];
+    char payload[TRACE_MAX_PAYLOAD + 1];
+};
+
+// Where a trace is kept: a file on LittleFS, or in memory on the host
+class TraceFile
+{
+public:
+    virtual size_t read(uint8_t *buf, size_t size) = 0;
+    virtual size_t write(const uint8_t *buf, size_t size) = 0;
+    virtual void flush() = 0;
+};
+
+// Last value of every input, as read on the device or replayed from the trace
+int16_t inputPins[2][TRACE_MAX_PINS]; // Digital and analog
+int16_t inputDht[2];
+int64_t inputClock[2];
+bool inputClockKnown[2];
+unsigned long commandsReceived = 0; // Over MQTT or the WebSocket, a new one ends an idle wait
+
+// Recording
+bool tracing = false;
+bool traceFull = false; // Recording stopped at TRACE_MAX_SIZE
+TraceFile *traceFile = nullptr;
+uint8_t traceBuffer[TRACE_BUFFER_SIZE];
+size_t traceLength = 0;
+size_t traceSize = 0; // Bytes written to the file so far
+unsigned long traceStarted = 0;
+unsigned long traceLast = 0; // Trace time of the previous record
+unsigned long traceFlushed = 0;
+
+#ifdef MEDIBOX_REPLAY
+// Replaying
+TraceFile *replayFile = nullptr;
+TraceRecord replayRecord;
+bool replayPending = false;
+unsigned long replayNow = 0;       // Virtual clock, in trace time
+bool replaySensorsChanged = false; // A recorded sensor reading was fed since the last read
+#endif
+
+// Provided by the includer
+void handleCommand(const char *command, const char *payload);
+#ifndef MEDIBOX_REPLAY
+unsigned long millis();
+int digitalRead(uint8_t pin);
+uint16_t analogRead(uint8_t pin);
+TempAndHumidity readTempAndHumidity();
+int64_t readClockMs(int clock);
+#endif
+
+// Forget the previous input values
+void resetInputs()
+{
+    for (int pin = 0; pin < TRACE_MAX_PINS; pin++)
+    {
+        inputPins[TRACE_DIGITAL][pin] = HIGH; // Buttons are pulled up
+        inputPins[TRACE_ANALOG][pin] = 0;
+    }
+    inputDht[0] = DHT_UNKNOWN;
+    inputDht[1] = DHT_UNKNOWN;
+    inputClockKnown[CLOCK_LOCAL] = false;
+    inputClockKnown[CLOCK_NTP] = false;
+}
+
+// Write the buffered records to the file
+void traceFlush(unsigned long now)
+{
+    if (traceLength > 0)
+    {
+        traceSize += traceFile->write(traceBuffer, traceLength);
+        traceLength = 0;
+    }
+    traceFile->flush();
+    traceFlushed = now;
+}
+
+void traceByte(uint8_t b)
+{
+    if (traceLength == TRACE_BUFFER_SIZE)
+    {
+        traceFlush(traceFlushed);
+    }
+    traceBuffer[traceLength++] = b;
+}
+
+void traceVarint(uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        traceByte(value | 0x80);
+        value >>= 7;
+    }
+    traceByte(value);
+}
+
+// Signed values are zigzag encoded so small negative numbers stay short
+void traceValue(int64_t value)
+{
+    traceVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+void traceString(const char *text)
+{
+    size_t length = strlen(text);
+    traceVarint(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        traceByte(text[i]);
+    }
+}
+
+// Start recording a new trace into an empty file
+void traceBegin(TraceFile *file, unsigned long now)
+{
+    traceFile = file;
+    traceFile->write((const uint8_t *)TRACE_MAGIC, 4);
+
+    // Record the current value of every input when it is next read
+    for (int pin = 0; pin < TRACE_MAX_PINS; pin++)
+    {
+        inputPins[TRACE_DIGITAL][pin] = -1;
+        inputPins[TRACE_ANALOG][pin] = -1;
+    }
+    inputDht[0] = DHT_UNKNOWN;
+    inputClockKnown[CLOCK_LOCAL] = false;
+    inputClockKnown[CLOCK_NTP] = false;
+
+    traceStarted = now;
+    traceLast = 0;
+    traceLength = 0;
+    traceSize = 4;
+    traceFlushed = now;
+    traceFull = false;
+    tracing = true;
+}
+
+// Stop recording, with every record written to the file
+void traceEnd(unsigned long now)
+{
+    if (!tracing)
+    {
+        return;
+    }
+    tracing = false;
+    traceFlush(now);
+}
+
+// Start a record, or stop recording when it might not fit under TRACE_MAX_SIZE
+// Returns false if the record is not to be written
+bool traceRecord(uint8_t kind, uint8_t channel, unsigned long now)
+{
+    if (!tracing)
+    {
+        return false;
+    }
+    if (traceSize + traceLength + TRACE_MAX_RECORD > TRACE_MAX_SIZE)
+    {
+        traceFull = true;
+        traceEnd(now);
+        return false;
+    }
+
+    unsigned long at = now - traceStarted;
+    traceVarint(at - traceLast);
+    traceLast = at;
+    traceByte(kind);
+    traceByte(channel);
+    return true;
+}
+
+// Called every pass of loop(): flush the buffered records TRACE_FLUSH_MS after the last flush, so none
+// waits in RAM for longer, even with no record after it
+// Buttons and commands are written through at once, as a hang or crash usually follows one of them
+// Returns false once the trace is full
+bool traceStep(unsigned long now)
+{
+    if (tracing && traceLength > 0 && now - traceFlushed >= TRACE_FLUSH_MS)
+    {
+        traceFlush(now);
+    }
+    return !traceFull;
+}
+
+bool traceReadVarint(TraceFile *file, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t b;
+        if (file->read(&b, 1) != 1)
+        {
+            return false;
+        }
+        value |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool traceReadValue(TraceFile *file, int64_t &value)
+{
+    uint64_t zigzag;
+    if (!traceReadVarint(file, zigzag))
+    {
+        return false;
+    }
+    value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    return true;
+}
+
+bool traceReadString(TraceFile *file, char *text, size_t size)
+{
+    uint64_t length;
+    if (!traceReadVarint(file, length) || length >= size || file->read((uint8_t *)text, length) != length)
+    {
+        return false;
+    }
+    text[length] = '\0';
+    return true;
+}
+
+// Check that a trace starts with TRACE_MAGIC
+bool traceReadMagic(TraceFile *file)
+{
+    char magic[4];
+    return file->read((uint8_t *)magic, 4) == 4 && memcmp(magic, TRACE_MAGIC, 4) == 0;
+}
+
+// Read the next record of a trace after the one in r, false at its end
+bool traceRead(TraceFile *file, TraceRecord &r)
+{
+    uint64_t delta;
+    if (!traceReadVarint(file, delta) || file->read(&r.kind, 1) != 1 || file->read(&r.channel, 1) != 1)
+    {
+        return false;
+    }
+    r.at += delta;
+
+    switch (r.kind)
+    {
+    case TRACE_DIGITAL:
+    case TRACE_ANALOG:
+        return r.channel < TRACE_MAX_PINS && traceReadValue(file, r.value[0]);
+    case TRACE_DHT:
+        return traceReadValue(file, r.value[0]) && traceReadValue(file, r.value[1]);
+    case TRACE_CLOCK:
+        return r.channel <= CLOCK_NTP && traceReadValue(file, r.value[0]);
+    case TRACE_MESSAGE:
+        return traceReadString(file, r.command, sizeof(r.command)) &&
+               traceReadString(file, r.payload, sizeof(r.payload));
+    default:
+        return false;
+    }
+}
+
+#ifndef MEDIBOX_REPLAY
+// Record a changed pin reading
+void tracePin(uint8_t kind, int pin, int value)
+{
+    if (inputPins[kind][pin] == value)
+    {
+        return;
+    }
+    inputPins[kind][pin] = value;
+    if (traceRecord(kind, pin, millis()))
+    {
+        traceValue(value);
+        if (kind == TRACE_DIGITAL)
+        {
+            traceFlush(millis());
+        }
+    }
+}
+#endif
+
+unsigned long inputMillis()
+{
+#ifdef MEDIBOX_REPLAY
+    return replayNow;
+#else
+    return millis();
+#endif
+}
+
+int inputDigitalRead(int pin)
+{
+#ifdef MEDIBOX_REPLAY
+    return inputPins[TRACE_DIGITAL][pin];
+#else
+    int value = digitalRead(pin);
+    tracePin(TRACE_DIGITAL, pin, value);
+    return value;
+#endif
+}
+
+int inputAnalogRead(int pin)
+{
+#ifdef MEDIBOX_REPLAY
+    return inputPins[TRACE_ANALOG][pin];
+#else
+    int value = analogRead(pin);
+    tracePin(TRACE_ANALOG, pin, value);
+    return value;
+#endif
+}
+
+TempAndHumidity inputTempAndHumidity()
+{
+    TempAndHumidity data;
+#ifdef MEDIBOX_REPLAY
+    data.temperature = inputDht[0] == DHT_NAN ? NAN : inputDht[0] / 10.0f;
+    data.humidity = inputDht[1] == DHT_NAN ? NAN : inputDht[1] / 10.0f;
+#else
+    data = readTempAndHumidity();
+    int16_t temperature = isnan(data.temperature) ? DHT_NAN : lroundf(data.temperature * 10);
+    int16_t humidity = isnan(data.humidity) ? DHT_NAN : lroundf(data.humidity * 10);
+    if (temperature != inputDht[0] || humidity != inputDht[1])
+    {
+        inputDht[0] = temperature;
+        inputDht[1] = humidity;
+        if (traceRecord(TRACE_DHT, 0, millis()))
+        {
+            traceValue(temperature);
+            traceValue(humidity);
+        }
+    }
+#endif
+    return data;
+}
+
+// Milliseconds since the epoch on one of the clocks
+int64_t inputClockMs(int clock)
+{
+#ifdef MEDIBOX_REPLAY
+    return inputClock[clock] + replayNow;
+#else
+    int64_t now = readClockMs(clock);
+    int64_t offset = now - (millis() - traceStarted);
+    if (!inputClockKnown[clock] || llabs(offset - inputClock[clock]) >= TRACE_CLOCK_TOLERANCE_MS)
+    {
+        inputClock[clock] = offset;
+        inputClockKnown[clock] = true;
+        if (traceRecord(TRACE_CLOCK, clock, millis()))
+        {
+            traceValue(offset);
+        }
+    }
+    return now;
+#endif
+}
+
+// Broken down local time, false until the clock has been set
+bool inputLocalTime(struct tm *info)
+{
+    time_t now = inputClockMs(CLOCK_LOCAL) / 1000;
+    localtime_r(&now, info);
+    return info->tm_year > (2016 - 1900);
+}
+
+// Seconds since the epoch from the NTP client
+unsigned long inputEpoch()
+{
+    return inputClockMs(CLOCK_NTP) / 1000;
+}
+
+// Carry out a command received over MQTT or the WebSocket
+void inputMessage(const char *command, const char *payload)
+{
+    commandsReceived++;
+#ifndef MEDIBOX_REPLAY
+    if (strlen(command) < TRACE_MAX_COMMAND && strlen(payload) <= TRACE_MAX_PAYLOAD &&
+        traceRecord(TRACE_MESSAGE, 0, millis()))
+    {
+        traceString(command);
+        traceString(payload);
+        traceFlush(millis());
+    }
+#endif
+    handleCommand(command, payload);
+}
+
+#ifdef MEDIBOX_REPLAY
+void replayAdvance(unsigned long until);
+
+// Start replaying a trace with the inputs recorded at its start, false if it is not a trace
+bool replayBegin(TraceFile *file)
+{
+    replayFile = file;
+    replayRecord.at = 0;
+    replayNow = 0;
+    replayPending = traceReadMagic(file) && traceRead(file, replayRecord);
+    if (!replayPending)
+    {
+        return false;
+    }
+    replayAdvance(0);
+    return true;
+}
+
+// Feed the inputs recorded up to the given trace time to the firmware
+void replayAdvance(unsigned long until)
+{
+    while (replayPending && replayRecord.at <= until)
+    {
+        TraceRecord &r = replayRecord;
+        switch (r.kind)
+        {
+        case TRACE_DIGITAL:
+        case TRACE_ANALOG:
+            inputPins[r.kind][r.channel] = r.value[0];
+            replaySensorsChanged = replaySensorsChanged || r.kind == TRACE_ANALOG;
+            break;
+        case TRACE_DHT:
+            inputDht[0] = r.value[0];
+            inputDht[1] = r.value[1];
+            replaySensorsChanged = true;
+            break;
+        case TRACE_CLOCK:
+            inputClock[r.channel] = r.value[0];
+            inputClockKnown[r.channel] = true;
+            break;
+        case TRACE_MESSAGE:
+            inputMessage(r.command, r.payload);
+            break;
+        }
+        replayPending = traceRead(replayFile, replayRecord);
+    }
+}
+
+// Jump the virtual clock to the next deadline or recorded input, whichever comes first
+// Returns false once the whole trace has been fed
+bool replayJump(unsigned long deadline)
+{
+    if (!replayPending)
+    {
+        return false;
+    }
+    unsigned long next = replayNow + (deadline > 1 ? deadline : 1);
+    unsigned long record = replayRecord.at > replayNow + 1 ? replayRecord.at : replayNow + 1;
+    replayNow = next < record ? next : record;
+    replayAdvance(replayNow);
+    return true;
+}
+
+// Whether a recorded sensor reading was fed since the last call
+bool replaySensorsDue()
+{
+    bool due = replaySensorsChanged;
+    replaySensorsChanged = false;
+    return due;
+}
+#endif
@@ -0,0 +1,271 @@
+// Menu state machine, driven one button press at a time
+// Pure logic so that it also builds on the host: include it once, after the PB_* button pins and
+// n_alarms are defined. The includer provides the inputs, the drawing and the item callbacks
+// declared below.
+#pragma once
+
+#define DEBOUNCE_MS 50
+#define MENU_MESSAGE_MS 1000
+#define MAX_MENU_FIELDS 2
+
+// A value edited from the menu
+struct MenuField
+{
+    const char *label;
+    int min;
+    int max;
+    int step;
+};
+
+// An entry of the menu, editing its fields one after the other
+// load fills the values before editing and commit applies them once the last field is accepted
+struct MenuItem
+{
+    const char *label;
+    const MenuField *fields;
+    int n_fields;
+    int count; // Number of instances of the item, e.g. one per alarm
+    void (*load)(int index, int *values);
+    void (*commit)(int index, const int *values);
+    const char *done; // Message shown after committing
+};
+
+enum MenuState
+{
+    MENU_IDLE,
+    MENU_BROWSE,
+    MENU_EDIT,
+    MENU_MESSAGE
+};
+
+// Menu state
+MenuState menu_state = MENU_IDLE;
+int current_mode = 0;
+int menu_item = 0;
+int menu_instance = 0;
+int menu_field = 0;
+int menu_values[MAX_MENU_FIELDS];
+unsigned long menu_message_until = 0;
+
+// Button state, see read_button()
+int button_last = -1;             // Button held at the last reported change, -1 if none
+unsigned long button_changed = 0; // When it was reported
+
+// Provided by the includer
+unsigned long inputMillis();
+int inputDigitalRead(int pin);
+void clear_display();
+void draw_menu_item();
+void draw_field();
+void draw_field_value();
+void draw_menu_message(const char *message);
+void load_timezone(int index, int *values);
+void commit_timezone(int index, const int *values);
+void load_alarm(int index, int *values);
+void commit_alarm(int index, const int *values);
+void commit_disable_alarms(int index, const int *values);
+
+// Function to read the buttons without blocking
+// Returns the button that was pressed since the last call, or -1 if none
+int read_button()
+{
+    static const int buttons[] = {PB_UP, PB_DOWN, PB_OK, PB_CANCEL};
+
+    int pressed = -1;
+    for (int i = 0; i < 4; i++)
+    {
+        if (inputDigitalRead(buttons[i]) == LOW)
+        {
+            pressed = buttons[i];
+            break;
+        }
+    }
+
+    // Only report a press on its leading edge, once the previous state has settled
+    if (pressed == button_last || inputMillis() - button_changed < DEBOUNCE_MS)
+    {
+        return -1;
+    }
+    button_last = pressed;
+    button_changed = inputMillis();
+    return pressed;
+}
+
+// Time until a button change can be reported again, 0 once the last one has settled
+unsigned long button_settle_left()
+{
+    unsigned long elapsed = inputMillis() - button_changed;
+    return elapsed < DEBOUNCE_MS ? DEBOUNCE_MS - elapsed : 0;
+}
+
+// Menu tables
+// Each field is stepped with UP/DOWN and wraps around inside [min, max]
+constexpr MenuField timezone_fields[] = {
+    {"offset hours", -12, 14, 1},
+    {"offset minutes", 0, 45, 15},
+};
+
+constexpr MenuField alarm_fields[] = {
+    {"hour", 0, 23, 1},
+    {"minute", 0, 59, 1},
+};
+
+// Items with a count greater than one are repeated, with the instance number added to the label
+constexpr MenuItem menu_items[] = {
+    {"Set   Time Zone", timezone_fields, 2, 1, load_timezone, commit_timezone, "Timezone  is Set"},
+    {"Set   Alarm", alarm_fields, 2, n_alarms, load_alarm, commit_alarm, "Alarm is set"},
+    {"Disable Alarms", nullptr, 0, 1, nullptr, commit_disable_alarms, "Alarms Disabled"},
+};
+
+constexpr int n_menu_items = sizeof(menu_items) / sizeof(menu_items[0]);
+
+constexpr int count_modes(int item = 0)
+{
+    return item < n_menu_items ? menu_items[item].count + count_modes(item + 1) : 0;
+}
+
+constexpr int max_modes = count_modes();
+
+// Function to find the item and instance behind the current mode
+void menu_locate(int mode)
+{
+    menu_item = 0;
+    while (mode >= menu_items[menu_item].count)
+    {
+        mode -= menu_items[menu_item].count;
+        menu_item++;
+    }
+    menu_instance = mode;
+}
+
+// Function to show a message for a while before going back to the menu
+void show_menu_message(const char *message)
+{
+    draw_menu_message(message);
+    menu_state = MENU_MESSAGE;
+    menu_message_until = inputMillis() + MENU_MESSAGE_MS;
+}
+
+// Function to commit the edited values of the selected item
+void commit_menu_item()
+{
+    const MenuItem &item = menu_items[menu_item];
+    item.commit(menu_instance, menu_values);
+    show_menu_message(item.done);
+}
+
+// Function to open the selected menu item
+void open_menu_item()
+{
+    const MenuItem &item = menu_items[menu_item];
+    if (item.n_fields == 0)
+    {
+        commit_menu_item();
+        return;
+    }
+
+    item.load(menu_instance, menu_values);
+    menu_field = 0;
+    menu_state = MENU_EDIT;
+    draw_field();
+}
+
+// Function to open the menu from the clock screen
+void go_to_menu()
+{
+    menu_state = MENU_BROWSE;
+    menu_locate(current_mode);
+    draw_menu_item();
+}
+
+// Function to leave the menu, e.g. for a ringing alarm
+void close_menu()
+{
+    menu_state = MENU_IDLE;
+}
+
+// Function to step the menu state machine with the latest button press
+void update_menu(int pressed)
+{
+    if (menu_state == MENU_BROWSE)
+    {
+        if (pressed == PB_UP || pressed == PB_DOWN)
+        {
+            current_mode = (current_mode + (pressed == PB_UP ? 1 : max_modes - 1)) % max_modes;
+            menu_locate(current_mode);
+            draw_menu_item();
+        }
+        else if (pressed == PB_OK)
+        {
+            open_menu_item();
+        }
+        else if (pressed == PB_CANCEL)
+        {
+            menu_state = MENU_IDLE;
+            clear_display();
+        }
+    }
+    else if (menu_state == MENU_EDIT)
+    {
+        const MenuItem &item = menu_items[menu_item];
+        const MenuField &field = item.fields[menu_field];
+
+        if (pressed == PB_UP || pressed == PB_DOWN)
+        {
+            int value = menu_values[menu_field] + (pressed == PB_UP ? field.step : -field.step);
+            if (value > field.max)
+            {
+                value = field.min;
+            }
+            else if (value < field.min)
+            {
+                value = field.max;
+            }
+            menu_values[menu_field] = value;
+            draw_field_value();
+        }
+        else if (pressed == PB_OK)
+        {
+            menu_field++;
+            if (menu_field < item.n_fields)
+            {
+                draw_field();
+            }
+            else
+            {
+                commit_menu_item();
+            }
+        }
+        else if (pressed == PB_CANCEL)
+        {
+            // Leave the item without changing anything
+            menu_state = MENU_BROWSE;
+            draw_menu_item();
+        }
+    }
+    else if (menu_state == MENU_MESSAGE)
+    {
+        if ((long)(inputMillis() - menu_message_until) >= 0)
+        {
+            menu_state = MENU_BROWSE;
+            draw_menu_item();
+        }
+    }
+}
+
+// Function to run the menu alongside everything else, one button press at a time
+// OK on the clock screen opens it
+void menu_step(int pressed)
+{
+    if (menu_state == MENU_IDLE)
+    {
+        if (pressed == PB_OK)
+        {
+            go_to_menu();
+        }
+    }
+    else
+    {
+        update_menu(pressed);
+    }
+}
@@ -0,0 +1,250 @@
+// OTA firmware updates
+// The image is streamed into the inactive app partition a chunk per loop() so alarms keep running.
+// It is only booted once its signature checks out against the public key built into the firmware.
+// The board specific parts (HTTP, flash, crypto) sit behind OtaPort so the update also runs on the host.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define OTA_CHUNK_SIZE 1024
+#define OTA_MAX_RETRIES 5
+#define OTA_STALL_MS 10000           // Reconnect when no data arrived for this long
+#define OTA_HEALTH_TIMEOUT_MS 120000 // Time a new image has to reach the broker before rolling back
+#define OTA_MAX_URL 160
+#define OTA_MAX_SIGNATURE 72 // DER encoded ECDSA P-256 signature
+
+class OtaPort
+{
+public:
+    // Request the image from offset on, with a Range header when offset > 0, and return the HTTP status
+    virtual int get(const char *url, size_t offset) = 0;
+    virtual int available() = 0; // Bytes ready to read, -1 once the connection is gone
+    virtual size_t read(uint8_t *buf, size_t size) = 0;
+    virtual void close() = 0;
+
+    // The inactive app partition
+    virtual size_t partitionSize() = 0;
+    virtual bool begin() = 0;
+    virtual bool write(const uint8_t *buf, size_t size) = 0;
+    virtual void abort() = 0;
+    virtual bool activate() = 0; // Check the image and boot it next time
+
+    // SHA-256 of the image, and the check of its signature with the built-in public key
+    virtual void hashStart() = 0;
+    virtual void hashUpdate(const uint8_t *buf, size_t size) = 0;
+    virtual bool verify(const uint8_t *signature, size_t length) = 0;
+
+    virtual unsigned long millis() = 0;
+    virtual void status(const char *status) = 0;
+};
+
+class OtaUpdate
+{
+public:
+    explicit OtaUpdate(OtaPort &port) : port(port)
+    {
+    }
+
+    // Start downloading an image, returns false (with the reason reported) if it cannot start
+    bool begin(const char *url, size_t size, const uint8_t *signature, size_t signatureLength)
+    {
+        if (active)
+        {
+            port.status("busy");
+            return false;
+        }
+        if (strlen(url) >= sizeof(this->url) || size == 0 || signatureLength == 0 ||
+            signatureLength > sizeof(this->signature))
+        {
+            port.status("invalid request");
+            return false;
+        }
+        if (size > port.partitionSize())
+        {
+            port.status("image does not fit");
+            return false;
+        }
+
+        strcpy(this->url, url);
+        memcpy(this->signature, signature, signatureLength);
+        this->signatureLength = signatureLength;
+        this->size = size;
+        written = 0;
+        retries = 0;
+        begun = false;
+        if (!restart())
+        {
+            port.status("failed to start");
+            return false;
+        }
+        active = true;
+        if (!connect())
+        {
+            fail("download failed");
+            return false;
+        }
+        port.status("downloading");
+        return true;
+    }
+
+    // Write the next chunk of the image, if any arrived
+    // Returns true once the image is checked and set to boot
+    bool step()
+    {
+        if (!active)
+        {
+            return false;
+        }
+
+        int available = port.available();
+        if (available < 0 || port.millis() - lastData > OTA_STALL_MS)
+        {
+            if (++retries > OTA_MAX_RETRIES || !connect())
+            {
+                fail("download failed");
+            }
+            return false;
+        }
+
+        uint8_t chunk[OTA_CHUNK_SIZE];
+        size_t n = size - written;
+        n = n < sizeof(chunk) ? n : sizeof(chunk);
+        n = n < (size_t)available ? n : (size_t)available;
+        if (n == 0)
+        {
+            return false;
+        }
+        n = port.read(chunk, n);
+        if (!port.write(chunk, n))
+        {
+            fail("write failed");
+            return false;
+        }
+        port.hashUpdate(chunk, n);
+        written += n;
+        lastData = port.millis();
+
+        int percent = written * 10 / size;
+        if (percent != progress)
+        {
+            char status[24];
+            progress = percent;
+            snprintf(status, sizeof(status), "downloading %d%%", percent * 10);
+            port.status(status);
+        }
+
+        return written == size && finish();
+    }
+
+    bool downloading() const
+    {
+        return active;
+    }
+
+    size_t received() const
+    {
+        return written;
+    }
+
+private:
+    // (Re)start writing the image from its first byte
+    bool restart()
+    {
+        if (begun)
+        {
+            port.abort();
+        }
+        written = 0;
+        progress = 0;
+        begun = port.begin();
+        if (begun)
+        {
+            port.hashStart();
+        }
+        return begun;
+    }
+
+    // Request the image from where the download stopped
+    bool connect()
+    {
+        port.close();
+        int code = port.get(url, written);
+        if (code == 200 && written > 0)
+        {
+            // The server ignored the range, so take the whole image again
+            if (!restart())
+            {
+                return false;
+            }
+        }
+        else if (code != 200 && code != 206)
+        {
+            return false;
+        }
+        lastData = port.millis();
+        return true;
+    }
+
+    // Abandon the update
+    void fail(const char *reason)
+    {
+        port.close();
+        port.abort();
+        begun = false;
+        active = false;
+        port.status(reason);
+    }
+
+    // Check the signature and switch to the new image
+    bool finish()
+    {
+        port.close();
+        active = false;
+        if (!port.verify(signature, signatureLength))
+        {
+            port.abort();
+            begun = false;
+            port.status("bad signature");
+            return false;
+        }
+        if (!port.activate())
+        {
+            port.status("invalid image");
+            return false;
+        }
+        port.status("rebooting");
+        return true;
+    }
+
+    OtaPort &port;
+    char url[OTA_MAX_URL];
+    uint8_t signature[OTA_MAX_SIGNATURE];
+    size_t signatureLength = 0;
+    size_t size = 0;
+    size_t written = 0;
+    int retries = 0;
+    int progress = 0;
+    unsigned long lastData = 0;
+    bool active = false;
+    bool begun = false; // The partition is being written
+};
+
+enum OtaHealth
+{
+    OTA_HEALTH_WAIT,
+    OTA_HEALTH_CONFIRM,
+    OTA_HEALTH_ROLLBACK
+};
+
+// Decide what happens to a new image on probation: kept once it reaches the broker, rolled back otherwise
+inline OtaHealth otaHealth(bool reachedBroker, unsigned long uptime)
+{
+    if (reachedBroker)
+    {
+        return OTA_HEALTH_CONFIRM;
+    }
+    return uptime > OTA_HEALTH_TIMEOUT_MS ? OTA_HEALTH_ROLLBACK : OTA_HEALTH_WAIT;
+}
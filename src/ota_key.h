@@ -0,0 +1,9 @@
+// Public key that OTA images must be signed with (ECDSA P-256 over the SHA-256 of the image)
+// The private half of this placeholder is not published: replace it with your own, see "OTA Updates" in the README
+#pragma once
+
+const char ota_public_key[] =
+    "-----BEGIN PUBLIC KEY-----\n"
+    "MFkwEwYHKoZIzj0CAQYIKoZIzj0DAQcDQgAEmQQzyuxHWZEpuPJ2Y0r6hj/QN14Y\n"
+    "69Oox2qCKcRul81Jlc6w9veqtF8OrZMjP1s4QBt5nJY7YWmAm2uAOrJeNg==\n"
+    "-----END PUBLIC KEY-----\n";
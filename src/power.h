@@ -0,0 +1,181 @@
+// Power management
+// In low power mode loop() sleeps until the next deadline instead of spinning. The deadlines are
+// worked out here, without the board, so that the sleep windows can be checked on the host.
+#pragma once
+
+#include <stdint.h>
+
+// Period of the clock and alarm updates in loop()
+// In low power mode the clock drops the seconds and is only refreshed when the minute changes
+#define UPDATE_PERIOD_MS 1000
+#define UPDATE_PERIOD_LOW_POWER_MS 60000
+
+// Period of the sensor updates and their MQTT messages
+#define SENSOR_PERIOD_MS 1000
+#define SENSOR_PERIOD_LOW_POWER_MS 30000
+
+#define MIN_SLEEP_MS 20   // Shorter windows are not worth sleeping for
+#define BUTTON_POLL_MS 20 // Worst case button latency while WiFi is kept up
+
+// Time from one clock update to the next, given the seconds read at the last one
+inline unsigned long clockPeriod(bool lowPower, int seconds)
+{
+    return lowPower ? UPDATE_PERIOD_LOW_POWER_MS - seconds * 1000UL : UPDATE_PERIOD_MS;
+}
+
+// Time left of a period that started at last, 0 once it is over
+inline unsigned long periodLeft(unsigned long now, unsigned long last, unsigned long period)
+{
+    unsigned long elapsed = now - last;
+    return elapsed < period ? period - elapsed : 0;
+}
+
+// Time left until a millis() time, 0 once it has come
+inline unsigned long untilLeft(unsigned long now, unsigned long until)
+{
+    return (long)(until - now) > 0 ? until - now : 0;
+}
+
+// Time until an alarm, from the time of day in seconds read at the last clock update
+// 0 for the whole minute the alarm is due in
+inline unsigned long alarmLeft(long daySeconds, int hour, int minute)
+{
+    long alarmSeconds = (hour * 60L + minute) * 60;
+    if (alarmSeconds / 60 == daySeconds / 60)
+    {
+        return 0;
+    }
+    return ((alarmSeconds - daySeconds + 24 * 60 * 60) % (24 * 60 * 60)) * 1000UL;
+}
+
+// Time until an epoch time in seconds, 0 once it has passed
+inline unsigned long epochLeft(unsigned long target, unsigned long epoch)
+{
+    return target > epoch ? (target - epoch) * 1000UL : 0;
+}
+
+// Length of one light sleep, waking up in time to feed the watchdog
+inline unsigned long lightSleepWindow(unsigned long window, unsigned long watchdogMs)
+{
+    return window < watchdogMs / 2 ? window : watchdogMs / 2;
+}
+
+// Length of one idle wait while WiFi is kept up, checking the buttons in between
+inline unsigned long pollSlice(unsigned long window, unsigned long elapsed)
+{
+    unsigned long left = window - elapsed;
+    return left < BUTTON_POLL_MS ? left : BUTTON_POLL_MS;
+}
+
+// Everything the next deadline depends on, gathered from the firmware's state on each pass of loop()
+struct PowerInputs
+{
+    unsigned long now; // millis()
+    bool lowPower;
+    unsigned long clockLast;          // Last clock update
+    unsigned long clockPeriod;        // See clockPeriod()
+    unsigned long sensorLast;         // Last sensor reading
+    unsigned long sensorPeriod;       // 0 when the sensors are not read on a timer
+    long daySeconds;                  // Time of day read at the last clock update
+    unsigned long epoch;              // Local clock, in seconds since the epoch
+    bool alarmsEnabled;
+    int alarms;
+    const int *alarmHours;
+    const int *alarmMinutes;
+    const bool *alarmTriggered;
+    const unsigned long *snoozeUntil; // Epoch to ring a snoozed alarm again, 0 if not snoozed
+    bool scheduled;                   // Buzzer schedule
+    unsigned long scheduledTime;      // On the NTP clock
+    unsigned long ntpEpoch;
+    bool menuIdle;
+    bool menuMessage;               // A menu message is shown until menuMessageUntil
+    unsigned long menuMessageUntil;
+    unsigned long buttonSettleLeft; // Until a button change can be reported again, 0 if it can
+    bool buzzer;
+    bool ringing;
+    unsigned long ringLeft;         // Until the ringing alarm's next note or its timeout
+    bool downloading;
+};
+
+// Time until something has to run in loop(), in milliseconds
+inline unsigned long nextDeadline(const PowerInputs &in)
+{
+    unsigned long window = periodLeft(in.now, in.clockLast, in.clockPeriod);
+    if (in.sensorPeriod > 0)
+    {
+        unsigned long sensor = periodLeft(in.now, in.sensorLast, in.sensorPeriod);
+        window = sensor < window ? sensor : window;
+    }
+    for (int i = 0; in.alarmsEnabled && i < in.alarms; i++)
+    {
+        // Alarms, from the time read at the last clock update
+        if (!in.alarmTriggered[i])
+        {
+            unsigned long alarm = alarmLeft(in.daySeconds, in.alarmHours[i], in.alarmMinutes[i]);
+            window = alarm < window ? alarm : window;
+        }
+        // Snoozed alarms
+        if (in.snoozeUntil[i] != 0)
+        {
+            unsigned long snooze = epochLeft(in.snoozeUntil[i], in.epoch);
+            window = snooze < window ? snooze : window;
+        }
+    }
+
+    // Buzzer schedule, which goes off once its time is past
+    if (in.scheduled)
+    {
+        unsigned long schedule = epochLeft(in.scheduledTime + 1, in.ntpEpoch);
+        window = schedule < window ? schedule : window;
+    }
+
+    // The ringing alarm plays its next note, or counts as missed
+    if (in.ringing)
+    {
+        window = in.ringLeft < window ? in.ringLeft : window;
+    }
+    // The menu goes back from its message
+    if (in.menuMessage)
+    {
+        unsigned long message = untilLeft(in.now, in.menuMessageUntil);
+        window = message < window ? message : window;
+    }
+    // A button that changed during the debounce time is read again once it is over
+    if (in.buttonSettleLeft > 0)
+    {
+        window = in.buttonSettleLeft < window ? in.buttonSettleLeft : window;
+    }
+    return window;
+}
+
+// Whether the clock update, which also rings the alarms, is due: once its period is over, or early for
+// an alarm that waited for another one to be answered or a snooze that ran out, which low power mode
+// would otherwise leave to the next minute
+inline bool clockDue(const PowerInputs &in)
+{
+    if (in.now - in.clockLast >= in.clockPeriod)
+    {
+        return true;
+    }
+    for (int i = 0; in.alarmsEnabled && !in.ringing && i < in.alarms; i++)
+    {
+        if ((!in.alarmTriggered[i] && alarmLeft(in.daySeconds, in.alarmHours[i], in.alarmMinutes[i]) == 0) ||
+            (in.snoozeUntil[i] != 0 && epochLeft(in.snoozeUntil[i], in.epoch) == 0))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// How long loop() may sleep, 0 when it has to keep running
+// The menu polls the buttons, the buzzer needs its clock running and downloads need the network
+inline unsigned long sleepWindow(const PowerInputs &in)
+{
+    if (!in.lowPower || !in.menuIdle || in.buzzer || in.ringing || in.downloading)
+    {
+        return 0;
+    }
+    unsigned long window = nextDeadline(in);
+    return window < MIN_SLEEP_MS ? 0 : window;
+}
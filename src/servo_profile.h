@@ -0,0 +1,53 @@
+// Servo profiles
+// A profile precomputes the servo angle for every intensity level of each LDR,
+// so adjusting the motor is a single table lookup
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#define INTENSITY_LEVELS 256
+#define LDR_RIGHT 0
+#define LDR_LEFT 1
+
+struct ServoProfileParams
+{
+    char id;              // Drop-down option, 0 for an unused slot
+    float minAngle;       // Minimum angle
+    float controllingFac; // Controlling factor
+    float gamma;          // Response curve exponent, 1 for linear
+    float offset[2];      // Multiplier of minAngle for the right and left LDR
+};
+
+struct ServoProfile
+{
+    ServoProfileParams params;
+    uint8_t angles[2][INTENSITY_LEVELS];
+};
+
+// Scale an analog reading in [0, maxValue] to the nearest intensity level, with integer maths
+inline uint8_t intensityLevel(int reading, int maxValue)
+{
+    return (reading * (INTENSITY_LEVELS - 1) + maxValue / 2) / maxValue;
+}
+
+// Fill the angle table of a profile
+// Each entry is the angle the formula gives at that intensity, truncated like Servo::write() does
+inline void buildProfile(ServoProfile &profile)
+{
+    const ServoProfileParams &p = profile.params;
+    for (int side = 0; side < 2; side++)
+    {
+        for (int level = 0; level < INTENSITY_LEVELS; level++)
+        {
+            double intensity = (double)level / (INTENSITY_LEVELS - 1);
+            if (p.gamma != 1)
+            {
+                intensity = pow(intensity, p.gamma);
+            }
+            double angle = p.minAngle * p.offset[side] + (180.0 - p.minAngle) * intensity * p.controllingFac;
+            angle = angle > 180.0 ? 180.0 : angle < 0.0 ? 0.0 : angle;
+            profile.angles[side][level] = (uint8_t)angle;
+        }
+    }
+}
@@ -9,28 +9,97 @@
 #include <WiFiUdp.h>
 #include <ESP32Servo.h>
 #include <ArduinoJson.h>
+#include <Preferences.h>
+#include <esp_sleep.h>
+#include <esp_pm.h>
+#include <driver/gpio.h>
+#include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/pk.h>
+#include <LittleFS.h>
+#include <sys/time.h>
+#include <ESPAsyncWebServer.h>
+#include <esp_partition.h>
+#include <esp_task_wdt.h>
+#include <esp_system.h>
+#include "status_page.h"
+#include "servo_profile.h"
+#include "power.h"
+#include "ota.h"
+#include "ota_key.h"
+#include "topics.h"
+#include "web_commands.h"
+#include "dose_log.h"
+#include "supervisor.h"
+#ifdef MEDIBOX_MQTT_TLS
+#include "tls_client.h"
+#endif
 
 void setupWifi();
+void onWifiDisconnected(WiFiEvent_t event, WiFiEventInfo_t info);
 void setupMqtt();
+void setupIdentity();
+const char *deviceTopic(const char *name);
 void print_line(String text, int column, int row, int text_size);
 void connectToBroker();
+#ifdef MEDIBOX_MQTT_TLS
+bool loadCerts();
+void publishTlsStats();
+#endif
 void buzzerOn(bool on);
 void receiveCallback(char *topic, byte *payload, unsigned int length);
+void handleCommand(const char *command, const char *payloadCharAr);
 void print_time_now(void);
-void update_time();
-void ring_alarm();
 void update_time_with_check_alarm(void);
 void checkSchedule();
 unsigned long getTime();
-int wait_for_button_press();
-void go_to_menu();
-void set_alarm(int alarm);
-void run_mode(int mode);
 void check_temp_and_hum();
 void updateTemperature();
-void set_timezone();
 void updateLightIntensity();
-void AdjustServoMotor(double lightintensity, double D);
+void AdjustServoMotor(uint8_t level, int side);
+void loadProfiles();
+void saveProfiles();
+void selectProfile(char id);
+void publishProfile();
+void uploadProfile(const char *json);
+void updateCustomProfile(float angle, float factor);
+void setupPower();
+void setLowPowerMode(bool on);
+PowerInputs powerInputs();
+void sleepUntilNextEvent();
+void publishPowerStats();
+void setupOta();
+void otaBegin(const char *json);
+void otaStep();
+void otaCheckHealth();
+void setupInputs();
+TempAndHumidity readTempAndHumidity();
+int64_t readClockMs(int clock);
+void traceStart();
+void traceStop();
+void traceDump();
+void traceCheck();
+void replayStep();
+unsigned long clockUpdatePeriod();
+bool sensorsDue(unsigned long now);
+void setupWeb();
+void webStep();
+void setupDoseLog();
+void show_ring(bool on);
+void play_note(int frequency);
+void logDose(DoseRecord &record);
+void clear_display();
+void loadAlarms();
+void saveAlarms();
+void saveTriggered();
+void setupSupervisor();
+void supervisorStep();
+bool alarmPending();
+void publishResetRecord();
+void doseSync(uint32_t cursor);
+void publishAdherence(time_t from, time_t to);
 
 // Pin Definitions
 #define BUZZER 4
@@ -47,24 +116,54 @@ void AdjustServoMotor(double lightintensity, double D);
 #define MOTOR 18
 
 // Define variables for controlling the servo motor
-float minAngle = 30.0;   // Minimum angle
-float controllingFac = 0.75; // Controlling factor
-float customAngle;
-float customControlFac;
+#define N_PROFILES 8
+
+ServoProfile profiles[N_PROFILES] = {
+    {{'D', 30, 0.75, 1, {0.5, 1.5}}}, // default
+    {{'A', 30, 0.5, 1, {0.5, 1.5}}},
+    {{'B', 45, 0.3, 1, {0.5, 1.5}}},
+    {{'C', 60, 0.8, 1, {0.5, 1.5}}},
+    {{'X', 30, 0.75, 1, {0.5, 1.5}}}, // custom, set through the min-ang and ctrl-fac commands
+};
+ServoProfile *activeProfile = &profiles[0];
+
+ServoProfile *findProfile(char id);
+
+// MQTT broker, override with e.g. -DMEDIBOX_MQTT_HOST=\"192.168.1.10\" -DMEDIBOX_MQTT_PORT=8883
+#ifndef MEDIBOX_MQTT_HOST
+#define MEDIBOX_MQTT_HOST "test.mosquitto.org"
+#endif
+#ifndef MEDIBOX_MQTT_PORT
+#ifdef MEDIBOX_MQTT_TLS
+#define MEDIBOX_MQTT_PORT 8883
+#else
+#define MEDIBOX_MQTT_PORT 1883
+#endif
+#endif
 
 // Initialise clients and objects
 Servo motor;
+#ifdef MEDIBOX_MQTT_TLS
+TlsClient espClient;
+#else
 WiFiClient espClient;
+#endif
 PubSubClient mqttClient(espClient);
 WiFiUDP ntpUDP;
 NTPClient timeClient(ntpUDP);
 JsonDocument packet;
+Preferences preferences;
+
+// Device identity and MQTT topics, see topics.h
+char deviceId[DEVICE_ID_SIZE];
+char clientId[24];
+char topicBuffer[64];
+char statusTopic[40];    // Retained online/offline state, also the last will
 
 // NTP Configuration
 #define NTP_SERVER "pool.ntp.org"
 #define UTC_OFFSET_DST 0
-int UTC_OFFSET = 19800;
-int offsets[] = {0, 0}; // Default set for IST time zone
+int UTC_OFFSET = 19800; // Default set for IST time zone
 int offset_hours = 5;
 int offset_minutes = 30;
 
@@ -78,56 +177,178 @@ DHTesp dhtSensor;
 #define SCREEN_ADDRESS 0x3C
 Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
 
-// Global variables for time
-int days = 0;
-int hours = 0;
-int minutes = 0;
-int seconds = 0;
-
+// Global variables for time, the time of day is kept by alarms.h
 unsigned long timeNow = 0;
 unsigned long timeLast = 0;
 
-// Alarm configuration
-bool alarm_enabled = true;
-int n_alarms = 3;
-// centred number for easy choose
-int alarm_hours[] = {12, 12, 12};
-int alarm_minutes[] = {27, 27, 27};
-bool alarm_triggered[] = {false, false, false};
-// TODO: make isScheduledON like above and make all 3 alarms schedulable
+// Sensor readings, see power.h for the update periods
+unsigned long sensorLast = 0;
+TempAndHumidity sensorData;
+
+// Power management
+#define POWER_STATS_PERIOD_MS 3600000UL
+bool lowPowerMode = false;
+bool buzzerActive = false;
+unsigned long powerStatsLast = 0;
+unsigned long idleMs = 0;   // Time spent waiting with WiFi up since the last statistics
+unsigned long asleepMs = 0; // Time spent in light sleep since the last statistics
+
+// Supervisor, see supervisor.h
+// The task watchdog resets the board when loop() stops running for WDT_TIMEOUT_S
+#define WDT_TIMEOUT_S 30
+#define MQTT_RETRY_MS 5000
+#define MQTT_KEEPALIVE_S 15 // The broker drops the client after 1.5 times this without a packet
+#define RESET_RECORD_MAGIC 0x4D425253
+
+// Kept across resets other than power on, in memory the startup code does not clear
+struct ResetRecord
+{
+    uint32_t magic;
+    uint32_t boots;  // Resets since power on
+    uint32_t uptime; // Seconds since boot, updated by the supervisor
+    char cause[16];  // Component the supervisor reset the board for, empty for other resets
+};
+RTC_NOINIT_ATTR ResetRecord resetRecord;
+ResetRecord lastReset; // The record of the previous boot, published once connected
+esp_reset_reason_t lastResetReason;
+bool resetPublished = false;
+bool displayOk = false; // Alarms fall back to the buzzer and LED when the display is missing
+unsigned long supervisorLast = 0;
+volatile uint8_t wifiDisconnectReason = 0; // WIFI_REASON_* of the last disconnection, 0 before the first
+
+// OTA firmware updates, see ota.h
+// The port streams the image over HTTP(S) into the inactive app partition
+class BoardOtaPort : public OtaPort
+{
+public:
+    int get(const char *url, size_t offset);
+    int available();
+    size_t read(uint8_t *buf, size_t size);
+    void close();
+    size_t partitionSize();
+    bool begin();
+    bool write(const uint8_t *buf, size_t size);
+    void abort();
+    bool activate();
+    void hashStart();
+    void hashUpdate(const uint8_t *buf, size_t size);
+    bool verify(const uint8_t *signature, size_t length);
+    unsigned long millis();
+    void status(const char *status);
+
+private:
+    HTTPClient http;
+    WiFiClient plainClient;
+    WiFiClientSecure secureClient;
+    const esp_partition_t *partition = nullptr;
+    esp_ota_handle_t handle = 0;
+    mbedtls_sha256_context sha;
+};
+
+BoardOtaPort otaPort;
+OtaUpdate ota(otaPort);
+bool otaPendingVerify = false;
+bool otaRestartPending = false;      // A new image is set to boot, once no alarm rings
+const char *otaBootStatus = nullptr; // Published once connected after a reboot
+
+// Inputs, see inputs.h
+// Traces are recorded into a file on LittleFS, which is also where a replay build reads them from
+#define TRACE_FILE "/trace.bin"
+
+#include "inputs.h"
+
+class FileTrace : public TraceFile
+{
+public:
+    File file;
+
+    size_t read(uint8_t *buf, size_t size);
+    size_t write(const uint8_t *buf, size_t size);
+    void flush();
+};
+
+FileTrace traceStorage;
+#ifdef MEDIBOX_REPLAY
+unsigned long replayStarted = 0;
+#endif
+
+// Local web server
+// Serves the status page and pushes the live state over a WebSocket, so the box can be
+// watched and controlled from the LAN without the broker
+#define WEB_PUSH_PERIOD_MS 1000
+#define WEB_QUEUE_LENGTH 4
+
+// A command received over the WebSocket, handed over to loop()
+struct WebCommand
+{
+    char command[TRACE_MAX_COMMAND];
+    char payload[TRACE_MAX_PAYLOAD + 1];
+};
+
+AsyncWebServer webServer(80);
+AsyncWebSocket webSocket("/ws");
+QueueHandle_t webCommands;
+unsigned long webPushLast = 0;
+volatile bool webClientJoined = false;
+uint8_t lightLevel = 0; // Last intensity level, for the status page
+int servoAngle = 0;
+
+// Alarms and doses, see alarms.h
+#include "alarms.h"
+
+// Dose log, see dose_log.h
+// Kept in the doselog partition, or in a file on LittleFS with a partition table that has none
+#define DOSE_FILE "/doselog.bin"
+#define DOSE_FILE_SECTORS 5 // With the one holding the magic
+
+class PartitionDoseStorage : public DoseStorage
+{
+public:
+    const esp_partition_t *partition = nullptr;
+
+    size_t size();
+    bool read(size_t offset, void *buf, size_t size);
+    bool write(size_t offset, const void *buf, size_t size);
+    bool erase(size_t offset, size_t size);
+};
 
+class FileDoseStorage : public DoseStorage
+{
+public:
+    bool open();
+    size_t size();
+    bool read(size_t offset, void *buf, size_t size);
+    bool write(size_t offset, const void *buf, size_t size);
+    bool erase(size_t offset, size_t size);
+
+private:
+    File file;
+};
+
+PartitionDoseStorage dosePartition;
+FileDoseStorage doseFile;
+DoseLog doseLog;
+
+void publishDoses(const DoseRecord *records, int n, uint32_t cursor, uint32_t next, bool more);
+
+// TODO: make isScheduledON like the alarms and make all 3 alarms schedulable
 // Variables for schedule
 bool isScheduledON = false; // Indicate if the schedule is enabled
 unsigned long scheduledOnTime;
 
-// Musical notes for the buzzer
-int n_notes = 8;
-int C = 262;
-int D = 294;
-int E = 330;
-int F = 349;
-int G = 392;
-int A = 440;
-int B = 494;
-int C_H = 523;
-int notes[] = {C, D, E, F, G, A, B, C_H};
-
 // Arrays to store data for MQTT messages
 char tempAr[6];
 char motorAr[6];
-char angleAr[6];
-char ctrlAr[6];
+char profileJson[80];
 
 // Constants for analog reading
-const float analogMinValue = 0.0;
-const float analogMaxValue = 1023.0;
-const float intensityMin = 0.0;
-const float intensityMax = 1.0;
+const int analogMaxValue = 1023;
 
 // User interface configuration
-int current_mode = 0;
-int max_modes = 5;
-String modes[] = {"1 - Set   Time Zone", "2 - Set   Alarm 1", "3 - Set   Alarm 2", "4 - Set   Alarm 3", "5- Disable Alarms"};
+#define MENU_VALUE_ROW 48 // Below the (at most three line) field prompt
+
+// Menu state machine, after the buttons and alarms it is built from
+#include "menu.h"
 
 void setup()
 {
@@ -147,65 +368,101 @@ void setup()
 
     // Initialize serial monitor and OLED display
     Serial.begin(9600);
-    if (!display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS))
+    setupSupervisor();
+    displayOk = display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS);
+    if (!displayOk)
     {
+        // Carry on without it, the supervisor keeps trying to bring it back
         Serial.println(F("SSD1306 allocation failed"));
-        for (;;)
-            ;
     }
 
+    setupInputs();
+    setupOta();
+    setupDoseLog();
+    setupIdentity();
+#ifndef MEDIBOX_REPLAY
     setupWifi();
     setupMqtt();
+    setupWeb();
+#endif
 
     dhtSensor.setup(DHTPIN, DHTesp::DHT22);
     timeClient.begin();
     timeClient.setTimeOffset(5.5 * 3600);
 
-    // Turn on OLED display
-    display.display();
-    delay(2000);
-
     // Configure NTP time synchronization
     configTime(UTC_OFFSET, UTC_OFFSET_DST, NTP_SERVER);
 
-    display.clearDisplay();
+    clear_display();
 
     print_line("Welcome to MediBox!", 0, 10, 2);
-    display.clearDisplay();
+    clear_display();
 
-    // Publish initial configuration to MQTT
-    // connectToBroker();
-    customAngle = 30;
-    customControlFac = 0;
-    mqttClient.publish("MQTT-SET-ANG", "30");
-    mqttClient.publish("MQTT-SET-FAC", "0.75");
+    // Restore the servo profiles, the active one is published once connected to MQTT
+    loadProfiles();
+    loadAlarms();
+    setupPower();
 }
 
 void loop()
 {
     // TODO: optimise all these processes
+#ifndef MEDIBOX_REPLAY
     if (!mqttClient.connected())
     {
         connectToBroker();
     }
-    // Update time and check for alarms
-    update_time_with_check_alarm();
+    mqttClient.loop();
+#endif
 
     checkSchedule(); // TODO: Integrate check schedule with update_time_with_check_alarm
 
-    updateLightIntensity(); // Read light intensity from LDR
+    // A ringing alarm takes the buttons from the menu until it is answered
+    int pressed = read_button();
+    if (ringing >= 0)
+    {
+        ring_step(pressed);
+    }
+    else
+    {
+        menu_step(pressed);
+    }
+
+    timeNow = inputMillis();
+    if (sensorsDue(timeNow))
+    {
+        sensorLast = timeNow;
+
+        updateLightIntensity(); // Read light intensity from LDR
+        updateTemperature();
+        // TODO: Implement updateHumidity();
+    }
 
-    // Check if the OK button is pressed to navigate to the menu
-    if (digitalRead(PB_OK) == LOW)
+    if (clockDue(powerInputs()))
     {
-        delay(200); // Debouncing push button
-        go_to_menu();
+        timeLast = timeNow;
+
+        // Update time and check for alarms
+        update_time_with_check_alarm();
+
+        // Check temperature and humidity
+        check_temp_and_hum(); // Try to remove this
     }
 
-    // Check temperature and humidity
-    check_temp_and_hum(); // Try to remove this
-    updateTemperature();
-    // TODO: Implement updateHumidity();
+    otaStep();
+    otaCheckHealth();
+
+    publishPowerStats();
+    supervisorStep();
+#ifndef MEDIBOX_REPLAY
+    webStep();
+    traceCheck();
+#endif
+#ifdef MEDIBOX_REPLAY
+    replayStep();
+#else
+    sleepUntilNextEvent();
+#endif
 }
 
 // Setup WiFi connection
@@ -214,29 +471,92 @@ void setupWifi()
     Serial.println();
     Serial.print("Connecting to ");
     Serial.println("Wokwi-GUEST");
+    // Alarms must not wait for the network: loop() connects to the broker once WiFi is up,
+    // and the supervisor keeps reconnecting in the background
+    WiFi.onEvent(onWifiDisconnected, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
     WiFi.begin("Wokwi-GUEST", "");
+}
+
+// Derive the device id and client id from the factory MAC address
+void setupIdentity()
+{
+    formatDeviceId(deviceId, ESP.getEfuseMac());
+    formatClientId(clientId, sizeof(clientId), deviceId);
+    formatTopic(statusTopic, sizeof(statusTopic), deviceId, "status");
+    Serial.printf("Device id %s\n", deviceId);
+}
+
+// Full topic of one of this device's messages, valid until the next call
+const char *deviceTopic(const char *name)
+{
+    return formatTopic(topicBuffer, sizeof(topicBuffer), deviceId, name);
+}
+
+#ifdef MEDIBOX_MQTT_TLS
+// Certificates are flashed to the certs partition as NUL separated PEMs:
+// the CA first, then optionally the client certificate and its key
+#define CERTS_MAX_SIZE 8192
+char *certs = nullptr;
+
+bool loadCerts()
+{
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "certs");
+    if (partition == nullptr)
+    {
+        Serial.println("No certs partition");
+        return false;
+    }
 
-    while (WiFi.status() != WL_CONNECTED)
+    size_t size = min((size_t)partition->size, (size_t)CERTS_MAX_SIZE);
+    certs = (char *)malloc(size + 1);
+    if (certs == nullptr || esp_partition_read(partition, 0, certs, size) != ESP_OK)
     {
-        delay(500);
-        Serial.print(".");
+        Serial.println("Could not read the certs partition");
+        return false;
     }
+    certs[size] = '\0';
 
-    Serial.println("Wifi connected");
-    Serial.print("IP Address: ");
-    Serial.println(WiFi.localIP());
+    // Erased flash reads as 0xFF, so a missing client certificate shows as a missing PEM header
+    char *ca = certs;
+    char *cert = ca + strlen(ca) + 1;
+    char *key = cert < certs + size ? cert + strlen(cert) + 1 : certs + size;
+    if (strncmp(ca, "-----BEGIN", 10) != 0 || !espClient.setCACert(ca))
+    {
+        Serial.println("Invalid CA certificate");
+        return false;
+    }
+    if (cert < certs + size && strncmp(cert, "-----BEGIN", 10) == 0)
+    {
+        if (key >= certs + size || !espClient.setCertificate(cert, key))
+        {
+            Serial.println("Invalid client certificate or key");
+            return false;
+        }
+    }
+    return true;
 }
+#endif
 
 // Setup MQTT client
 void setupMqtt()
 {
-    mqttClient.setServer("test.mosquitto.org", 1883);
+#ifdef MEDIBOX_MQTT_TLS
+    loadCerts();
+#endif
+    mqttClient.setServer(MEDIBOX_MQTT_HOST, MEDIBOX_MQTT_PORT);
     mqttClient.setCallback(receiveCallback);
+    mqttClient.setBufferSize(1024); // Room for a batch of dose records
+    mqttClient.setKeepAlive(MQTT_KEEPALIVE_S);
 }
 
 // Function to print a line on the OLED display
 void print_line(String text, int column, int row, int text_size)
 {
+    if (!displayOk)
+    {
+        return;
+    }
     display.setTextSize(text_size);
     display.setTextColor(SSD1306_WHITE);
     display.setCursor(column, row);
@@ -244,33 +564,74 @@ void print_line(String text, int column, int row, int text_size)
     display.display();
 }
 
+#ifdef MEDIBOX_MQTT_TLS
+// Publish the cost of the last TLS handshake
+void publishTlsStats()
+{
+    JsonDocument doc;
+    doc["handshakeMs"] = espClient.handshakeMs();
+    doc["resumed"] = espClient.resumed();
+    doc["heapPeak"] = espClient.handshakeHeap();
+    char buffer[80];
+    serializeJson(doc, buffer);
+    mqttClient.publish(deviceTopic("tls"), buffer);
+}
+#endif
+
 // Connect to MQTT broker
+// Makes one attempt every MQTT_RETRY_MS, so that loop() keeps running while the broker is away
+unsigned long mqttAttemptLast = 0;
+
 void connectToBroker()
 {
-    while (!mqttClient.connected())
+    if (WiFi.status() != WL_CONNECTED || (mqttAttemptLast != 0 && millis() - mqttAttemptLast < MQTT_RETRY_MS))
+    {
+        return;
+    }
+    mqttAttemptLast = millis();
+
+    Serial.println("Attempting MQTT connetion...");
+    // Persistent session, the broker keeps the subscriptions and queues QoS 1 commands while offline
+    if (mqttClient.connect(clientId, nullptr, nullptr, statusTopic, 1, true, "offline", false))
     {
-        Serial.println("Attempting MQTT connetion...");
-        if (mqttClient.connect("ESP-55200255"))
+        Serial.println("Connected");
+        mqttClient.publish(statusTopic, "online", true);
+        mqttClient.subscribe(deviceTopic("cmd/#"), 1);
+        mqttClient.subscribe(TOPIC_ROOT "/" GROUP_ID "/cmd/#", 1);
+        publishProfile();
+#ifdef MEDIBOX_MQTT_TLS
+        publishTlsStats();
+#endif
+        if (otaBootStatus != nullptr)
         {
-            Serial.println("Connected");
-            mqttClient.subscribe("MQTT-ON-OFF");
-            mqttClient.subscribe("MQTT-SCH-ON");
-            mqttClient.subscribe("MQTT-DROP-DOWN");
-            mqttClient.subscribe("MQTT-MIN-ANG");
-            mqttClient.subscribe("MQTT-CTRL-FAC");
+            mqttClient.publish(deviceTopic("ota-status"), otaBootStatus);
+            otaBootStatus = nullptr;
         }
-        else
+        if (!resetPublished)
         {
-            Serial.print("Connection failed with state: ");
-            Serial.println(mqttClient.state());
-            delay(5000);
+            publishResetRecord();
         }
     }
+    else
+    {
+        Serial.print("Connection failed with state: ");
+        Serial.println(mqttClient.state());
+    }
+}
+
+// Function to clear the OLED display
+void clear_display()
+{
+    if (displayOk)
+    {
+        display.clearDisplay();
+    }
 }
 
 // Function to turn the buzzer on or off
 void buzzerOn(bool on)
 {
+    buzzerActive = on;
     if (on)
     {
         tone(BUZZER, 256);
@@ -288,22 +649,42 @@ void receiveCallback(char *topic, byte *payload, unsigned int length)
     Serial.print(topic);
     Serial.print("] ");
 
-    char payloadCharAr[length];
+    char payloadCharAr[length + 1];
 
     for (int i = 0; i < length; i++)
     {
         Serial.print((char)payload[i]);
         payloadCharAr[i] = (char)payload[i];
     }
+    payloadCharAr[length] = '\0';
 
     Serial.println();
 
+    const char *command = topicCommand(topic);
+    if (command == nullptr)
+    {
+        return;
+    }
+
+    // Firmware is only taken when addressed to this box, not to the whole fleet
+    if (strcmp(command, "ota") == 0 && strcmp(topic, deviceTopic("cmd/ota")) != 0)
+    {
+        Serial.println("OTA refused on a fleet topic");
+        return;
+    }
+
+    inputMessage(command, payloadCharAr);
+}
+
+// Function to carry out a command received over MQTT (or replayed)
+void handleCommand(const char *command, const char *payloadCharAr)
+{
     // Process received MQTT messages
-    if (strcmp(topic, "MQTT-ON-OFF") == 0)
+    if (strcmp(command, "on-off") == 0)
     {
         buzzerOn(payloadCharAr[0] == '1');
     }
-    else if (strcmp(topic, "MQTT-SCH-ON") == 0)
+    else if (strcmp(command, "sch-on") == 0)
     {
         if (payloadCharAr[0] == 'N')
         {
@@ -317,88 +698,76 @@ void receiveCallback(char *topic, byte *payload, unsigned int length)
             Serial.println("Scheduled Time is " + String(scheduledOnTime));
         }
     }
-    // Update minimum angle
-    if (strcmp(topic, "MQTT-MIN-ANG") == 0)
+    // Update minimum angle of the custom profile
+    else if (strcmp(command, "min-ang") == 0)
     {
-        minAngle = atof(payloadCharAr);
-        Serial.println(minAngle);
+        updateCustomProfile(atof(payloadCharAr), findProfile('X')->params.controllingFac);
     }
-    // Update controlling factor
-    if (strcmp(topic, "MQTT-CTRL-FAC") == 0)
+    // Update controlling factor of the custom profile
+    else if (strcmp(command, "ctrl-fac") == 0)
     {
-        controllingFac = atof(payloadCharAr);
-        Serial.println(controllingFac);
+        updateCustomProfile(findProfile('X')->params.minAngle, atof(payloadCharAr));
     }
-    // Update minimum angle and controlling factor based on drop-down selection
-    if (strcmp(topic, "MQTT-DROP-DOWN") == 0)
+    // Switch to the profile selected in the drop-down
+    else if (strcmp(command, "drop-down") == 0)
     {
-        // Handle different drop-down options
-        if (payloadCharAr[0] == 'D') // default
-        {
-            minAngle = 30;
-            controllingFac = 0.75;
-            Serial.println("Angle:" + String(minAngle) + " and Control Factor: " + String(controllingFac));
-            mqttClient.publish("MQTT-SET-ANG", "30");
-            mqttClient.publish("MQTT-SET-FAC", "0.75");
-        }
-        else if (payloadCharAr[0] == 'A')
-        {
-            minAngle = 30;
-            controllingFac = 0.5;
-            Serial.println("Angle:" + String(minAngle) + " and Control Factor: " + String(controllingFac));
-            mqttClient.publish("MQTT-SET-ANG", "30");
-            mqttClient.publish("MQTT-SET-FAC", "0.5");
-        }
-        else if (payloadCharAr[0] == 'B')
+        selectProfile(payloadCharAr[0]);
+    }
+    // Add or replace a profile
+    else if (strcmp(command, "profile-upload") == 0)
+    {
+        uploadProfile(payloadCharAr);
+    }
+    else if (strcmp(command, "low-power") == 0)
+    {
+        setLowPowerMode(payloadCharAr[0] == '1');
+    }
+    else if (strcmp(command, "ota") == 0)
+    {
+        otaBegin(payloadCharAr);
+    }
+    // Send the dose records from the given sequence number on
+    else if (strcmp(command, "dose-sync") == 0)
+    {
+        doseSync(strtoul(payloadCharAr, nullptr, 10));
+    }
+    // Send the adherence of the day the given number of days ago, 0 being today so far
+    else if (strcmp(command, "adherence") == 0)
+    {
+        time_t from = local_midnight() - atoi(payloadCharAr) * 24L * 60 * 60;
+        publishAdherence(from, from + 24 * 60 * 60);
+    }
+#ifndef MEDIBOX_REPLAY
+    // Record the inputs into a trace, or print it as hex on the serial monitor
+    else if (strcmp(command, "trace") == 0)
+    {
+        if (strcmp(payloadCharAr, "start") == 0)
         {
-            minAngle = 45;
-            controllingFac = 0.3;
-            Serial.println("Angle:" + String(minAngle) + " and Control Factor: " + String(controllingFac));
-            mqttClient.publish("MQTT-SET-ANG", "45");
-            mqttClient.publish("MQTT-SET-FAC", "0.3");
+            traceStart();
         }
-        else if (payloadCharAr[0] == 'C')
+        else if (strcmp(payloadCharAr, "stop") == 0)
         {
-            minAngle = 60;
-            controllingFac = 0.8;
-            Serial.println("Angle:" + String(minAngle) + " and Control Factor: " + String(controllingFac));
-            mqttClient.publish("MQTT-SET-ANG", "60");
-            mqttClient.publish("MQTT-SET-FAC", "0.8");
+            traceStop();
         }
-        else if (payloadCharAr[0] == 'X') // Custom
+        else if (strcmp(payloadCharAr, "dump") == 0)
         {
-            String(customAngle, 2).toCharArray(angleAr, 6);
-            String(customControlFac, 2).toCharArray(ctrlAr, 6);
-            mqttClient.publish("MQTT-SET-ANG", angleAr);
-            mqttClient.publish("MQTT-SET-FAC", ctrlAr);
-
-            if (strcmp(topic, "MQTT-MIN-ANG") == 0)
-            {
-                minAngle = atof(payloadCharAr);
-                customAngle = minAngle;
-                // Serial.println("New custom angle is: " + String(minAngle));
-                String(minAngle, 2).toCharArray(angleAr, 6);
-                mqttClient.publish("MQTT-SET-ANG", angleAr);
-            }
-            if (strcmp(topic, "MQTT-CTRL-FAC") == 0)
-            {
-                controllingFac = atof(payloadCharAr);
-                customControlFac = controllingFac;
-                String(customControlFac, 2).toCharArray(ctrlAr, 6);
-                // Serial.println("New custom factor is: " + String(controllingFac));
-                mqttClient.publish("MQTT-SET-FAC", ctrlAr);
-            }
+            traceDump();
         }
     }
+#endif
 }
 
 // Function to print the current time on the OLED display
 void print_time_now(void)
 {
-    display.clearDisplay();
+    if (!displayOk)
+    {
+        return;
+    }
+    clear_display();
 
     struct tm timeinfo;
-    getLocalTime(&timeinfo);
+    inputLocalTime(&timeinfo);
 
     char timeDay[4];
     strftime(timeDay, 4, "%a", &timeinfo); // day of the week
@@ -420,6 +789,13 @@ void print_time_now(void)
     strftime(timeMinute, 3, "%M", &timeinfo); // minute
     print_line(String(timeMinute), 40, 25, 2);
 
+    // Low power mode only refreshes the clock once a minute
+    if (lowPowerMode)
+    {
+        display.display();
+        return;
+    }
+
     print_line(":", 60, 25, 2);
 
     char timeSecond[3];
@@ -429,66 +805,54 @@ void print_time_now(void)
     display.display();
 }
 
-// Function to update the time
-void update_time()
+// Function to update time and check for alarms
+void update_time_with_check_alarm(void)
 {
-    struct tm timeinfo;
-    getLocalTime(&timeinfo, UTC_OFFSET);
+    update_time();
+#ifndef MEDIBOX_REPLAY
+    // The menu and a ringing alarm own the display while they are on
+    // A replay leaves the clock off the display, it would only slow every step down
+    if (menu_state == MENU_IDLE && ringing < 0)
+    {
+        print_time_now();
+    }
+#endif
 
-    hours = timeinfo.tm_hour;
-    minutes = timeinfo.tm_min;
-    seconds = timeinfo.tm_sec;
+    check_alarms();
 }
 
-// Function to ring the alarm
-void ring_alarm()
+// Function to show a ringing alarm on the display and LED, or clear it away once answered
+void show_ring(bool on)
 {
-    display.clearDisplay();
-    print_line("TAKE YOUR MEDICINE!", 0, 0, 2);
-
-    digitalWrite(LED_1, HIGH);
-
-    bool break_happened = false;
-
-    // Ring the buzzer
-    while (break_happened == false && digitalRead(PB_CANCEL) == HIGH)
+    clear_display();
+    if (on)
     {
-        for (int i = 0; i < n_notes; i++)
-        {
-            if (digitalRead(PB_CANCEL) == LOW)
-            {
-                delay(200);
-                break_happened = true;
-                break;
-            }
-            tone(BUZZER, notes[i]);
-            delay(500);
-            noTone(BUZZER);
-            delay(2);
-        }
+        print_line("TAKE YOUR MEDICINE!", 0, 0, 2);
     }
-
-    digitalWrite(LED_1, LOW);
-    display.clearDisplay();
+    digitalWrite(LED_1, on ? HIGH : LOW);
 }
 
-// Function to update time and check for alarms
-void update_time_with_check_alarm(void)
+// Function to play a note of the ringing alarm, 0 for silence
+void play_note(int frequency)
 {
-    update_time();
-    print_time_now();
+    if (frequency > 0)
+    {
+        tone(BUZZER, frequency);
+    }
+    else
+    {
+        noTone(BUZZER);
+    }
+}
 
-    if (alarm_enabled == true)
+// Function to keep how a dose went and push it to the dashboard
+void logDose(DoseRecord &record)
+{
+    if (!doseLog.append(record) && doseLog.available())
     {
-        for (int i = 0; i < n_alarms; i++)
-        {
-            if (alarm_triggered[i] == false && alarm_hours[i] == hours && alarm_minutes[i] == minutes)
-            {
-                ring_alarm();
-                alarm_triggered[i] = true;
-            }
-        }
+        Serial.println("Dose log write failed");
     }
+    publishDoses(&record, 1, record.seq, record.seq + 1, false);
 }
 
 void checkSchedule()
@@ -499,7 +863,7 @@ void checkSchedule()
         if (currentTime > scheduledOnTime)
         {
             buzzerOn(true);
-            mqttClient.publish("MQTT-SCH-OFF-ESP", "0");
+            mqttClient.publish(deviceTopic("sch-off"), "0");
             Serial.println("Current Time is " + String(currentTime));
             Serial.println("Scheduled Time is " + String(scheduledOnTime));
             isScheduledON = false;
@@ -510,368 +874,1332 @@ void checkSchedule()
 // Get current time from NTP server
 unsigned long getTime()
 {
-    timeClient.update();
-    return timeClient.getEpochTime();
+    return inputEpoch();
 }
 
-// Function to wait for a button press
-int wait_for_button_press()
+size_t PartitionDoseStorage::size()
 {
-    while (true)
-    {
-        if (digitalRead(PB_UP) == LOW)
-        {
-            delay(200);
-            return PB_UP;
-        }
-        else if (digitalRead(PB_DOWN) == LOW)
-        {
-            delay(200);
-            return PB_DOWN;
-        }
-        else if (digitalRead(PB_OK) == LOW)
-        {
-            delay(200);
-            return PB_OK;
-        }
-        else if (digitalRead(PB_CANCEL) == LOW)
-        {
-            delay(200);
-            return PB_CANCEL;
-        }
+    return partition->size;
+}
 
-        update_time();
-    }
+bool PartitionDoseStorage::read(size_t offset, void *buf, size_t size)
+{
+    return esp_partition_read(partition, offset, buf, size) == ESP_OK;
 }
 
-// Function to navigate to the menu
-void go_to_menu()
+bool PartitionDoseStorage::write(size_t offset, const void *buf, size_t size)
 {
-    while (digitalRead(PB_CANCEL) == HIGH)
-    {
-        display.clearDisplay();
-        print_line(modes[current_mode], 0, 0, 2);
+    return esp_partition_write(partition, offset, buf, size) == ESP_OK;
+}
 
-        int pressed = wait_for_button_press();
-        if (pressed == PB_UP)
-        {
-            delay(200);
-            current_mode += 1;
-            current_mode = current_mode % max_modes;
-        }
-        else if (pressed == PB_DOWN)
-        {
-            delay(200);
-            current_mode -= 1;
-            if (current_mode < 0)
-            {
-                current_mode = max_modes - 1;
-            }
-        }
-        else if (pressed == PB_OK)
-        {
-            delay(200);
-            run_mode(current_mode);
-        }
-        else if (pressed == PB_CANCEL)
-        {
-            delay(200);
-            break;
-        }
-    }
+bool PartitionDoseStorage::erase(size_t offset, size_t size)
+{
+    return esp_partition_erase_range(partition, offset, size) == ESP_OK;
 }
 
-// Function to set an alarm
-void set_alarm(int alarm)
+// Open the log file, creating it erased the first time
+bool FileDoseStorage::open()
 {
-    int temp_hour = alarm_hours[alarm];
-    alarm_enabled = true;
-    while (true)
+    if (LittleFS.exists(DOSE_FILE))
     {
-        display.clearDisplay();
-        print_line("Enter hour: " + String(temp_hour), 0, 0, 2);
-
-        int pressed = wait_for_button_press();
-        if (pressed == PB_UP)
-        {
-            delay(200);
-            temp_hour += 1;
-            temp_hour = temp_hour % 24;
-        }
-        else if (pressed == PB_DOWN)
-        {
-            delay(200);
-            temp_hour -= 1;
-            if (temp_hour < 0)
-            {
-                temp_hour = 23;
-            }
-        }
-        else if (pressed == PB_OK)
+        file = LittleFS.open(DOSE_FILE, "r+");
+        if (file && file.size() >= DOSE_FILE_SECTORS * DOSE_SECTOR_SIZE)
         {
-            delay(200);
-            alarm_hours[alarm] = temp_hour;
-            break;
-        }
-        else if (pressed == PB_CANCEL)
-        {
-            delay(200);
-            break;
+            return true;
         }
+        file.close();
     }
+    // Also recreated when a power loss cut creating it short
+    file = LittleFS.open(DOSE_FILE, "w+");
+    return file && erase(0, DOSE_FILE_SECTORS * DOSE_SECTOR_SIZE);
+}
 
-    int temp_minute = alarm_minutes[alarm];
-    while (true)
-    {
-        display.clearDisplay();
-        print_line("Enter minute: " + String(temp_minute), 0, 0, 2);
-
-        int pressed = wait_for_button_press();
-        if (pressed == PB_UP)
-        {
-            delay(200);
-            temp_minute += 1;
-            temp_minute = temp_minute % 60;
-        }
-        else if (pressed == PB_DOWN)
-        {
-            delay(200);
-            temp_minute -= 1;
-            if (temp_minute < 0)
-            {
-                temp_minute = 59;
-            }
-        }
-        else if (pressed == PB_OK)
-        {
-            delay(200);
-            alarm_minutes[alarm] = temp_minute;
-            break;
-        }
-        else if (pressed == PB_CANCEL)
-        {
-            delay(200);
-            break;
-        }
-    }
+size_t FileDoseStorage::size()
+{
+    return file.size();
+}
 
-    display.clearDisplay();
-    print_line("Alarm is set", 0, 0, 2);
-    delay(1000);
+bool FileDoseStorage::read(size_t offset, void *buf, size_t size)
+{
+    return file.seek(offset) && file.read((uint8_t *)buf, size) == size;
 }
 
-// Function to run the selected mode
-void run_mode(int mode)
+// Flushed right away, LittleFS only commits a write to flash then
+bool FileDoseStorage::write(size_t offset, const void *buf, size_t size)
 {
-    if (mode == 0)
+    if (!file.seek(offset) || file.write((const uint8_t *)buf, size) != size)
     {
-        set_timezone();
-        UTC_OFFSET = 0;
-        if (offsets[0] < 0)
-        {
-            UTC_OFFSET = (UTC_OFFSET + (offsets[0] * 60 * 60 - 1 * offsets[1] * 60));
-        }
-        else
-        {
-            UTC_OFFSET = UTC_OFFSET + (offsets[0] * 60 * 60 + offsets[1] * 60);
-        }
-        configTime(UTC_OFFSET, UTC_OFFSET_DST, NTP_SERVER);
+        return false;
     }
-    else if (mode == 1 || mode == 2 || mode == 3)
+    file.flush();
+    return true;
+}
+
+bool FileDoseStorage::erase(size_t offset, size_t size)
+{
+    uint8_t erased[256];
+    memset(erased, 0xFF, sizeof(erased));
+    if (!file.seek(offset))
     {
-        set_alarm(mode - 1);
+        return false;
     }
-    else if (mode == 4)
+    for (size_t done = 0; done < size; done += sizeof(erased))
     {
-        alarm_enabled = false;
-        display.clearDisplay();
-        delay(200);
-        print_line("Alarms Disabled", 0, 0, 2);
-        delay(1000);
-        display.clearDisplay();
+        if (file.write(erased, sizeof(erased)) != sizeof(erased))
+        {
+            return false;
+        }
     }
+    file.flush();
+    return true;
 }
 
-// Function to check temperature and humidity
-void check_temp_and_hum()
+// Open the log in the doselog partition, or in a file when the partition table has none
+void setupDoseLog()
 {
-    TempAndHumidity data = dhtSensor.getTempAndHumidity();
-    if (data.temperature > 32)
+    dosePartition.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "doselog");
+    if (dosePartition.partition != nullptr)
     {
-        digitalWrite(LED_TEMP, HIGH);
-        print_line("TEMPETATURE HIGH", 10, 45, 1);
-        digitalWrite(LED_TEMP, LOW);
+        doseLog.begin(&dosePartition);
     }
-    else if (data.temperature < 26)
+    else if (doseFile.open())
     {
-        digitalWrite(LED_TEMP, HIGH);
-        print_line("TEMPETATURE LOW", 10, 45, 1);
-        digitalWrite(LED_TEMP, LOW);
+        Serial.println("No doselog partition, keeping the dose log in " DOSE_FILE);
+        doseLog.begin(&doseFile);
     }
 
-    if (data.humidity > 80)
+    if (!doseLog.available())
     {
-        digitalWrite(LED_HUM, HIGH);
-        print_line("HUMIDITY HIGH", 10, 55, 1);
-        digitalWrite(LED_HUM, LOW);
+        Serial.println("No dose log, doses are only published");
+        return;
     }
-    else if (data.humidity < 60)
+    Serial.printf("Dose log: next record %lu\n", (unsigned long)doseLog.next());
+}
+
+// Publish the records from cursor on, as
+// {"cursor":<seq>,"next":<seq>,"more":<bool>,"records":[[seq,scheduled,ringStart,latency,alarm,outcome],...]}
+// New records are pushed as they are logged; a dashboard that missed some asks for them with the dose-sync command
+void publishDoses(const DoseRecord *records, int n, uint32_t cursor, uint32_t next, bool more)
+{
+    char json[80 + DOSE_SYNC_BATCH * 48];
+    int length = snprintf(json, sizeof(json), "{\"cursor\":%lu,\"next\":%lu,\"more\":%s,\"records\":[",
+                          (unsigned long)cursor, (unsigned long)next, more ? "true" : "false");
+    for (int i = 0; i < n; i++)
     {
-        digitalWrite(LED_HUM, HIGH);
-        print_line("HUMIDITY LOW", 10, 55, 1);
-        digitalWrite(LED_HUM, LOW);
+        const DoseRecord &r = records[i];
+        length += snprintf(json + length, sizeof(json) - length, "%s[%lu,%lu,%lu,%u,%u,%u]", i > 0 ? "," : "",
+                           (unsigned long)r.seq, (unsigned long)r.scheduled, (unsigned long)r.ringStart,
+                           (unsigned)r.latency, (unsigned)r.alarm, (unsigned)r.outcome);
     }
+    snprintf(json + length, sizeof(json) - length, "]}");
+    mqttClient.publish(deviceTopic("doses"), json);
 }
 
-// Update temperature reading and publish to MQTT
-void updateTemperature()
+// Answer a dose-sync command
+void doseSync(uint32_t cursor)
 {
-    TempAndHumidity data = dhtSensor.getTempAndHumidity();
-    String(data.temperature, 2).toCharArray(tempAr, 6);
-
-    // Serial.println("Temperature is " + String(tempAr) + "°C");
-    mqttClient.publish("MQTT-TEMP", tempAr);
-    delay((1000));
+    DoseRecord records[DOSE_SYNC_BATCH];
+    int n = doseLog.collect(cursor, records, DOSE_SYNC_BATCH);
+    // A cursor past the end, e.g. after the log was erased, restarts from the next record
+    uint32_t next = n > 0 ? records[n - 1].seq + 1 : min(cursor, doseLog.next());
+    publishDoses(records, n, cursor, next, next < doseLog.next() && n == DOSE_SYNC_BATCH);
 }
 
-// Function to change timezone
-void set_timezone()
+// Publish the adherence over [from, to), see formatAdherence()
+void publishAdherence(time_t from, time_t to)
 {
-    int temp_offset_hours = offset_hours;
-    while (true)
+    if (!doseLog.available())
     {
-        display.clearDisplay();
-        print_line("Enter offset hours: " + String(temp_offset_hours), 0, 0, 2);
-
-        int pressed = wait_for_button_press();
-
-        if (pressed == PB_UP)
-        {
-            delay(200);
-            temp_offset_hours += 1;
-            temp_offset_hours = temp_offset_hours % 15; // max time zone was 14
-        }
-        else if (pressed == PB_DOWN)
-        {
-            delay(200);
-            temp_offset_hours -= 1;
-            if (temp_offset_hours < -12)
-            {
-                temp_offset_hours = 0;
-            }
-        }
-
-        else if (pressed == PB_OK)
-        {
-            delay(200);
-            offset_hours = temp_offset_hours;
-            offsets[0] = offset_hours;
-            break;
-        }
-        else if (pressed == PB_CANCEL)
-        {
-            delay(200);
-            break;
-        }
+        return;
     }
 
-    int temp_offset_minutes = offset_minutes;
-    while (true)
-    {
-        display.clearDisplay();
-        print_line("Enter offset minutes: " + String(temp_offset_minutes), 0, 0, 2);
-
-        int pressed = wait_for_button_press(); // when a button is pressed it is assigned to this
+    DoseSummary summary = doseSummary(doseLog, from, to);
 
-        if (pressed == PB_UP)
-        {
-            delay(200);
-            temp_offset_minutes += 15;
-            temp_offset_minutes = temp_offset_minutes % 60;
-        }
-        else if (pressed == PB_DOWN)
-        {
-            delay(200);
-            temp_offset_minutes -= 15;
-            if (temp_offset_minutes < 0)
-            {
-                temp_offset_minutes = 60;
-            }
-        }
+    struct tm day;
+    localtime_r(&from, &day);
+    char date[11];
+    strftime(date, sizeof(date), "%Y-%m-%d", &day);
 
-        else if (pressed == PB_OK)
-        {
-            delay(200);
-            offset_minutes = temp_offset_minutes;
-            offsets[1] = offset_minutes;
-            break;
-        }
-        else if (pressed == PB_CANCEL)
-        {
-            delay(200);
-            break;
-        }
-    }
+    char json[128];
+    formatAdherence(json, sizeof(json), date, summary);
+    Serial.printf("Adherence %s\n", json);
+    mqttClient.publish(deviceTopic("adherence"), json, true);
+}
 
-    display.clearDisplay();
-    print_line("Timezone  is Set", 0, 0, 2);
-    delay(1000);
+// Load and commit callbacks for the menu items
+void load_timezone(int index, int *values)
+{
+    values[0] = offset_hours;
+    values[1] = offset_minutes;
 }
 
-void updateLightIntensity()
+void commit_timezone(int index, const int *values)
 {
-    float rightLDR = analogRead(LDR1);
-    float leftLDR = analogRead(LDR2);
-    float intensity = 0;
+    offset_hours = values[0];
+    offset_minutes = values[1];
+
+    // Minutes follow the sign of the hours (e.g. -3:30 is -3h -30min)
+    if (offset_hours < 0)
+    {
+        UTC_OFFSET = offset_hours * 60 * 60 - offset_minutes * 60;
+    }
+    else
+    {
+        UTC_OFFSET = offset_hours * 60 * 60 + offset_minutes * 60;
+    }
+    configTime(UTC_OFFSET, UTC_OFFSET_DST, NTP_SERVER);
+}
+
+// Restore the alarms from flash, so that a reset does not lose them
+void loadAlarms()
+{
+    // The alarms already rung, dropped by doseCheckDay() once the clock shows they were for another day
+    int32_t triggered[2];
+    if (preferences.getBytesLength("triggered") == sizeof(triggered))
+    {
+        preferences.getBytes("triggered", triggered, sizeof(triggered));
+        triggered_day = triggered[0];
+        for (int i = 0; i < n_alarms; i++)
+        {
+            alarm_triggered[i] = triggered[1] & (1 << i);
+        }
+    }
+
+    int8_t stored[n_alarms * 2 + 1];
+    if (preferences.getBytesLength("alarms") != sizeof(stored))
+    {
+        return;
+    }
+    preferences.getBytes("alarms", stored, sizeof(stored));
+    for (int i = 0; i < n_alarms; i++)
+    {
+        alarm_hours[i] = stored[i * 2];
+        alarm_minutes[i] = stored[i * 2 + 1];
+    }
+    alarm_enabled = stored[n_alarms * 2];
+}
+
+void saveAlarms()
+{
+    int8_t stored[n_alarms * 2 + 1];
+    for (int i = 0; i < n_alarms; i++)
+    {
+        stored[i * 2] = alarm_hours[i];
+        stored[i * 2 + 1] = alarm_minutes[i];
+    }
+    stored[n_alarms * 2] = alarm_enabled;
+    preferences.putBytes("alarms", stored, sizeof(stored));
+}
+
+void saveTriggered()
+{
+    int32_t triggered[2] = {triggered_day, 0};
+    for (int i = 0; i < n_alarms; i++)
+    {
+        triggered[1] |= alarm_triggered[i] << i;
+    }
+    preferences.putBytes("triggered", triggered, sizeof(triggered));
+}
+
+// Function to draw the selected menu item
+void draw_menu_item()
+{
+    const MenuItem &item = menu_items[menu_item];
+    char label[32];
+
+    if (item.count > 1)
+    {
+        snprintf(label, sizeof(label), "%d - %s %d", current_mode + 1, item.label, menu_instance + 1);
+    }
+    else
+    {
+        snprintf(label, sizeof(label), "%d - %s", current_mode + 1, item.label);
+    }
+
+    clear_display();
+    print_line(label, 0, 0, 2);
+}
+
+// Function to redraw only the value of the field being edited
+void draw_field_value()
+{
+    if (displayOk)
+    {
+        display.fillRect(0, MENU_VALUE_ROW, SCREEN_WIDTH, SCREEN_HEIGHT - MENU_VALUE_ROW, SSD1306_BLACK);
+    }
+    print_line(String(menu_values[menu_field]), 0, MENU_VALUE_ROW, 2);
+}
+
+// Function to draw the prompt and value of the field being edited
+void draw_field()
+{
+    clear_display();
+    print_line("Enter " + String(menu_items[menu_item].fields[menu_field].label) + ":", 0, 0, 2);
+    draw_field_value();
+}
+
+// Function to draw a message shown after committing an item
+void draw_menu_message(const char *message)
+{
+    clear_display();
+    print_line(message, 0, 0, 2);
+}
+
+// Function to check temperature and humidity
+void check_temp_and_hum()
+{
+    if (menu_state != MENU_IDLE)
+    {
+        return;
+    }
+
+    // Uses the last reading taken by updateTemperature()
+    TempAndHumidity data = sensorData;
+    if (data.temperature > 32)
+    {
+        digitalWrite(LED_TEMP, HIGH);
+        print_line("TEMPETATURE HIGH", 10, 45, 1);
+        digitalWrite(LED_TEMP, LOW);
+    }
+    else if (data.temperature < 26)
+    {
+        digitalWrite(LED_TEMP, HIGH);
+        print_line("TEMPETATURE LOW", 10, 45, 1);
+        digitalWrite(LED_TEMP, LOW);
+    }
+
+    if (data.humidity > 80)
+    {
+        digitalWrite(LED_HUM, HIGH);
+        print_line("HUMIDITY HIGH", 10, 55, 1);
+        digitalWrite(LED_HUM, LOW);
+    }
+    else if (data.humidity < 60)
+    {
+        digitalWrite(LED_HUM, HIGH);
+        print_line("HUMIDITY LOW", 10, 55, 1);
+        digitalWrite(LED_HUM, LOW);
+    }
+}
+
+// Update temperature reading and publish to MQTT
+void updateTemperature()
+{
+    sensorData = inputTempAndHumidity();
+    String(sensorData.temperature, 2).toCharArray(tempAr, 6);
+
+    // Serial.println("Temperature is " + String(tempAr) + "°C");
+    mqttClient.publish(deviceTopic("temp"), tempAr);
+}
+
+
+void updateLightIntensity()
+{
+    int rightLDR = inputAnalogRead(LDR1);
+    int leftLDR = inputAnalogRead(LDR2);
     char dataJson[50];
 
-    if (rightLDR > leftLDR)
+    int side = rightLDR > leftLDR ? LDR_RIGHT : LDR_LEFT;
+    int reading = min(max(rightLDR, leftLDR), analogMaxValue);
+
+    uint8_t level = intensityLevel(reading, analogMaxValue);
+    lightLevel = level;
+    AdjustServoMotor(level, side);
+
+    packet["LDR"] = side == LDR_RIGHT ? "Right LED" : "Left LED";
+    packet["Intensity"] = String((float)level / (INTENSITY_LEVELS - 1));
+    serializeJson(packet, dataJson);
+    // Serial.println(dataJson);
+
+    mqttClient.publish(deviceTopic("light-intensity"), dataJson);
+}
+
+// Adjust servo motor position using the angle table of the active profile
+void AdjustServoMotor(uint8_t level, int side)
+{
+    int angle = activeProfile->angles[side][level];
+    // Serial.println(" and new angle: " + String(angle) + "°");
+    motor.write(angle);
+    servoAngle = angle;
+    snprintf(motorAr, sizeof(motorAr), "%d", angle - 90);
+    mqttClient.publish(deviceTopic("motor-ang"), motorAr);
+}
+
+// Find a profile by its drop-down option, returns nullptr if there is none
+ServoProfile *findProfile(char id)
+{
+    for (int i = 0; i < N_PROFILES; i++)
     {
-        packet["LDR"] = "Right LED";
-        if (rightLDR <= 1023)
+        if (profiles[i].params.id == id)
         {
-            intensity = (rightLDR - analogMinValue) / (analogMaxValue - analogMinValue);
-            // Serial.print("Right LDR " + String(intensity) + " intensity");
-            AdjustServoMotor(intensity, 0.5);
+            return &profiles[i];
         }
-        else
+    }
+    return nullptr;
+}
+
+// Restore the profiles and the selected one from flash and build their tables
+void loadProfiles()
+{
+    ServoProfileParams params[N_PROFILES];
+
+    preferences.begin("medibox", false);
+    if (preferences.getBytesLength("profiles") == sizeof(params))
+    {
+        preferences.getBytes("profiles", params, sizeof(params));
+        for (int i = 0; i < N_PROFILES; i++)
         {
-            intensity = 1;
-            // Serial.print("Right LDR " + String(intensity) + " intensity");
-            AdjustServoMotor(intensity, 0.5);
+            profiles[i].params = params[i];
         }
     }
+
+    for (int i = 0; i < N_PROFILES; i++)
+    {
+        if (profiles[i].params.id != 0)
+        {
+            buildProfile(profiles[i]);
+        }
+    }
+
+    ServoProfile *profile = findProfile(preferences.getChar("profile", 'D'));
+    if (profile != nullptr)
+    {
+        activeProfile = profile;
+    }
+}
+
+// Store the parameters of all profiles, the tables are rebuilt on boot
+void saveProfiles()
+{
+    ServoProfileParams params[N_PROFILES];
+    for (int i = 0; i < N_PROFILES; i++)
+    {
+        params[i] = profiles[i].params;
+    }
+    preferences.putBytes("profiles", params, sizeof(params));
+}
+
+// Switch the servo motor to another profile and acknowledge it
+void selectProfile(char id)
+{
+    ServoProfile *profile = findProfile(id);
+    if (id == 0 || profile == nullptr)
+    {
+        Serial.printf("Unknown profile %c\n", id);
+        return;
+    }
+
+    activeProfile = profile;
+    preferences.putChar("profile", id);
+    publishProfile();
+}
+
+// Publish the active profile as a single acknowledgement
+void publishProfile()
+{
+    const ServoProfileParams &p = activeProfile->params;
+    snprintf(profileJson, sizeof(profileJson), "{\"id\":\"%c\",\"minAngle\":%.2f,\"ctrlFac\":%.2f}",
+             p.id, p.minAngle, p.controllingFac);
+    Serial.printf("Profile %s\n", profileJson);
+    mqttClient.publish(deviceTopic("profile"), profileJson);
+}
+
+// Add or replace a profile from JSON, e.g.
+// {"id":"E","minAngle":40,"ctrlFac":0.6,"gamma":2,"offset":[0.5,1.5]}
+// Missing fields keep their current value, or the default profile's for a new one
+void uploadProfile(const char *json)
+{
+    JsonDocument doc;
+    DeserializationError error = deserializeJson(doc, json);
+    const char *id = doc["id"];
+    if (error || id == nullptr || id[0] == 0)
+    {
+        Serial.println("Invalid profile");
+        return;
+    }
+
+    ServoProfile *profile = findProfile(id[0]);
+    if (profile == nullptr)
+    {
+        profile = findProfile(0); // First unused slot
+        if (profile == nullptr)
+        {
+            Serial.println("No free profile slot");
+            return;
+        }
+        profile->params = profiles[0].params;
+        profile->params.id = id[0];
+    }
+
+    ServoProfileParams &p = profile->params;
+    p.minAngle = doc["minAngle"] | p.minAngle;
+    p.controllingFac = doc["ctrlFac"] | p.controllingFac;
+    p.gamma = doc["gamma"] | p.gamma;
+    p.offset[LDR_RIGHT] = doc["offset"][0] | p.offset[LDR_RIGHT];
+    p.offset[LDR_LEFT] = doc["offset"][1] | p.offset[LDR_LEFT];
+    if (p.gamma <= 0)
+    {
+        p.gamma = 1;
+    }
+
+    buildProfile(*profile);
+    saveProfiles();
+    if (profile == activeProfile)
+    {
+        publishProfile();
+    }
+}
+
+// Apply new values to the custom profile and switch to it
+void updateCustomProfile(float angle, float factor)
+{
+    ServoProfile *custom = findProfile('X');
+    custom->params.minAngle = angle;
+    custom->params.controllingFac = factor;
+    buildProfile(*custom);
+    saveProfiles();
+    selectProfile('X');
+}
+
+// Prepare the buttons for waking up from light sleep and restore the power mode
+void setupPower()
+{
+    esp_sleep_enable_gpio_wakeup();
+    setLowPowerMode(preferences.getBool("lowpower", false));
+}
+
+// Turn low power mode on or off
+void setLowPowerMode(bool on)
+{
+    lowPowerMode = on;
+    preferences.putBool("lowpower", on);
+
+    // Redraw the clock now in its new format
+    timeLast = inputMillis() - clockPeriod(on, seconds);
+
+    // Let the modem sleep between DTIM beacons while staying connected
+    WiFi.setSleep(on ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+
+#ifdef CONFIG_PM_ENABLE
+    // With tickless idle the CPU also light sleeps by itself while loop() waits
+    esp_pm_config_esp32_t pm_config = {
+        .max_freq_mhz = 240,
+        .min_freq_mhz = 80,
+        .light_sleep_enable = on,
+    };
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK)
+    {
+        Serial.printf("Automatic light sleep unavailable: %s\n", esp_err_to_name(err));
+    }
+#endif
+
+    Serial.printf("Low power mode %s\n", on ? "ON" : "OFF");
+}
+
+// Period of the clock update, which also checks the alarms
+// A replay refreshes it once a minute like low power mode does, on the minute the alarms go off,
+// so the virtual clock skips ahead instead of stepping through every second
+unsigned long clockUpdatePeriod()
+{
+#ifdef MEDIBOX_REPLAY
+    return clockPeriod(true, seconds);
+#else
+    return clockPeriod(lowPowerMode, seconds);
+#endif
+}
+
+// Whether the sensors are due to be read
+// A replay reads them when the trace feeds a new reading, as that is the only time they change
+bool sensorsDue(unsigned long now)
+{
+#ifdef MEDIBOX_REPLAY
+    return replaySensorsDue();
+#else
+    return now - sensorLast >= (lowPowerMode ? SENSOR_PERIOD_LOW_POWER_MS : SENSOR_PERIOD_MS);
+#endif
+}
+
+// The state the next deadline depends on, see nextDeadline()
+PowerInputs powerInputs()
+{
+    PowerInputs in = {};
+    in.now = inputMillis();
+    in.lowPower = lowPowerMode;
+    in.clockLast = timeLast;
+    in.clockPeriod = clockUpdatePeriod();
+    in.sensorLast = sensorLast;
+#ifndef MEDIBOX_REPLAY
+    in.sensorPeriod = lowPowerMode ? SENSOR_PERIOD_LOW_POWER_MS : SENSOR_PERIOD_MS;
+#endif
+    in.daySeconds = (hours * 60L + minutes) * 60 + seconds;
+    in.epoch = inputClockMs(CLOCK_LOCAL) / 1000;
+    in.alarmsEnabled = alarm_enabled;
+    in.alarms = n_alarms;
+    in.alarmHours = alarm_hours;
+    in.alarmMinutes = alarm_minutes;
+    in.alarmTriggered = alarm_triggered;
+    in.snoozeUntil = snooze_until;
+    in.scheduled = isScheduledON;
+    in.scheduledTime = scheduledOnTime;
+    in.ntpEpoch = isScheduledON ? inputEpoch() : 0;
+    in.menuIdle = menu_state == MENU_IDLE;
+    in.menuMessage = menu_state == MENU_MESSAGE;
+    in.menuMessageUntil = menu_message_until;
+    in.buttonSettleLeft = button_settle_left();
+    in.buzzer = buzzerActive;
+    in.ringing = ringing >= 0;
+    in.ringLeft = ringing >= 0 ? ring_left(in.now) : 0;
+    in.downloading = ota.downloading();
+    return in;
+}
+
+// Sleep until the next deadline, waking up early when a button is pressed
+void sleepUntilNextEvent()
+{
+    static const int buttons[] = {PB_UP, PB_DOWN, PB_OK, PB_CANCEL};
+
+    unsigned long window = sleepWindow(powerInputs());
+    if (window == 0)
+    {
+        return;
+    }
+
+    unsigned long start = millis();
+    if (WiFi.status() == WL_CONNECTED)
+    {
+        // A full light sleep would drop the connection, so let the CPU idle
+        // while the modem sleeps and check the buttons in between
+        // This is only counted as idle: the CPU light sleeps in delay() only with automatic light sleep
+        // The MQTT client keeps running meanwhile, to answer the broker's keepalive and take commands
+        // A lost broker connection is retried by loop() every MQTT_RETRY_MS
+        if (!mqttClient.connected())
+        {
+            window = min(window, (unsigned long)MQTT_RETRY_MS);
+        }
+        unsigned long commands = commandsReceived;
+        bool wake = false;
+        while (!wake && millis() - start < window)
+        {
+            esp_task_wdt_reset();
+            delay(pollSlice(window, millis() - start));
+            for (int i = 0; i < 4; i++)
+            {
+                wake = wake || digitalRead(buttons[i]) == LOW;
+            }
+            if (mqttClient.connected())
+            {
+                mqttClient.loop();
+            }
+            wake = wake || commandsReceived != commands || uxQueueMessagesWaiting(webCommands) > 0;
+        }
+        idleMs += millis() - start;
+    }
     else
     {
-        packet["LDR"] = "Left LED";
-        if (leftLDR <= 1023)
+        // Nothing to keep alive, so light sleep until the timer or a button wakes us up
+        window = lightSleepWindow(window, WDT_TIMEOUT_S * 1000UL);
+        for (int i = 0; i < 4; i++)
         {
-            intensity = (leftLDR - analogMinValue) / (analogMaxValue - analogMinValue);
-            // Serial.print("Left LDR " + String(intensity) + " intensity");
-            AdjustServoMotor(intensity, 1.5);
+            gpio_wakeup_enable((gpio_num_t)buttons[i], GPIO_INTR_LOW_LEVEL);
+        }
+        esp_sleep_enable_timer_wakeup(window * 1000ULL);
+        esp_light_sleep_start();
+        for (int i = 0; i < 4; i++)
+        {
+            gpio_wakeup_disable((gpio_num_t)buttons[i]);
+        }
+        asleepMs += millis() - start;
+    }
+}
+
+// Publish how long the device was awake, idle and asleep over the last hour, in seconds
+void publishPowerStats()
+{
+    unsigned long elapsed = millis() - powerStatsLast;
+    if (elapsed < POWER_STATS_PERIOD_MS)
+    {
+        return;
+    }
+
+    char statsJson[64];
+    snprintf(statsJson, sizeof(statsJson), "{\"awake\":%lu,\"idle\":%lu,\"asleep\":%lu}",
+             (elapsed - idleMs - asleepMs) / 1000, idleMs / 1000, asleepMs / 1000);
+    mqttClient.publish(deviceTopic("power"), statsJson);
+
+    powerStatsLast += elapsed;
+    idleMs = 0;
+    asleepMs = 0;
+}
+
+const char *resetReasonName(esp_reset_reason_t reason)
+{
+    switch (reason)
+    {
+    case ESP_RST_POWERON:
+        return "power-on";
+    case ESP_RST_EXT:
+        return "external";
+    case ESP_RST_SW:
+        return "software";
+    case ESP_RST_PANIC:
+        return "panic";
+    case ESP_RST_INT_WDT:
+        return "interrupt-watchdog";
+    case ESP_RST_TASK_WDT:
+        return "task-watchdog";
+    case ESP_RST_WDT:
+        return "watchdog";
+    case ESP_RST_DEEPSLEEP:
+        return "deep-sleep";
+    case ESP_RST_BROWNOUT:
+        return "brownout";
+    default:
+        return "unknown";
+    }
+}
+
+// Publish why the board last reset, e.g. {"reason":"software","cause":"mqtt","uptime":5400,"boots":2}
+// cause is the component the supervisor reset it for, and uptime how long it ran before the reset
+void publishResetRecord()
+{
+    char json[112];
+    snprintf(json, sizeof(json), "{\"reason\":\"%s\",\"cause\":\"%s\",\"uptime\":%lu,\"boots\":%lu}",
+             resetReasonName(lastResetReason), lastReset.cause, (unsigned long)lastReset.uptime,
+             (unsigned long)lastReset.boots);
+    Serial.printf("Reset %s\n", json);
+    resetPublished = mqttClient.publish(deviceTopic("reset"), json, true);
+}
+
+// Health checks and recovery steps of the supervised components
+// A display that stops answering is dropped at once, drawing to it would only waste time
+bool display_healthy()
+{
+    if (displayOk)
+    {
+        Wire.beginTransmission(SCREEN_ADDRESS);
+        displayOk = Wire.endTransmission() == 0;
+    }
+    return displayOk;
+}
+
+void display_recover(int step)
+{
+    Serial.println("Recovering display");
+    displayOk = display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS) && display_healthy();
+    if (!displayOk)
+    {
+        Serial.println("Display unavailable, alarms use the buzzer and LED only");
+    }
+}
+
+#ifndef MEDIBOX_REPLAY
+bool wifi_healthy()
+{
+    return WiFi.status() == WL_CONNECTED;
+}
+
+void wifi_recover(int step)
+{
+    Serial.printf("Recovering wifi, step %d\n", step + 1);
+    if (step == 0)
+    {
+        WiFi.reconnect();
+    }
+    else
+    {
+        WiFi.disconnect();
+        WiFi.begin("Wokwi-GUEST", "");
+    }
+}
+
+// Record why the driver last lost or failed to join the access point, from the WiFi event task
+void onWifiDisconnected(WiFiEvent_t event, WiFiEventInfo_t info)
+{
+    wifiDisconnectReason = info.wifi_sta_disconnected.reason;
+}
+
+// A driver that cannot join the access point is stuck, while one that no longer finds it, or that the
+// access point turns away, is not to blame
+// The driver reports why its last attempt failed, without a scan in the way of reconnecting; the
+// supervisor only resets the board if this holds at every check for a whole timeout
+bool wifi_internal_fault()
+{
+    if (WiFi.status() == WL_NO_SSID_AVAIL)
+    {
+        return false;
+    }
+    switch (wifiDisconnectReason)
+    {
+    case WIFI_REASON_NO_AP_FOUND:
+    case WIFI_REASON_BEACON_TIMEOUT:
+    case WIFI_REASON_AUTH_EXPIRE:
+    case WIFI_REASON_AUTH_FAIL:
+    case WIFI_REASON_ASSOC_FAIL:
+    case WIFI_REASON_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_802_1X_AUTH_FAILED:
+    case WIFI_REASON_CONNECTION_FAIL: return false;
+    default: return true;
+    }
+}
+
+// Without WiFi the broker cannot be blamed
+bool mqtt_healthy()
+{
+    return WiFi.status() != WL_CONNECTED || mqttClient.connected();
+}
+
+void mqtt_recover(int step)
+{
+    // Start over with a fresh connection
+    Serial.println("Recovering mqtt");
+    mqttClient.disconnect();
+    espClient.stop();
+#ifdef MEDIBOX_MQTT_TLS
+    espClient.forgetSession();
+#endif
+    mqttAttemptLast = 0;
+}
+#endif
+
+// Only a stuck WiFi driver is worth a reset: the display and the broker do not come back with one
+constexpr Component components[] = {
+    {"display", DISPLAY_TIMEOUT_MS, DISPLAY_STEPS, display_healthy, display_recover, nullptr},
+#ifndef MEDIBOX_REPLAY
+    {"wifi", WIFI_TIMEOUT_MS, WIFI_STEPS, wifi_healthy, wifi_recover, wifi_internal_fault},
+    {"mqtt", MQTT_TIMEOUT_MS, MQTT_STEPS, mqtt_healthy, mqtt_recover, nullptr},
+#endif
+};
+
+constexpr int n_components = sizeof(components) / sizeof(components[0]);
+Supervisor supervisor(components, n_components);
+
+// Read the reset record of the previous boot and start the task watchdog
+void setupSupervisor()
+{
+    lastResetReason = esp_reset_reason();
+    if (lastResetReason == ESP_RST_POWERON || resetRecord.magic != RESET_RECORD_MAGIC)
+    {
+        memset(&resetRecord, 0, sizeof(resetRecord));
+        resetRecord.magic = RESET_RECORD_MAGIC;
+    }
+    else
+    {
+        resetRecord.boots++;
+    }
+    resetRecord.cause[sizeof(resetRecord.cause) - 1] = '\0';
+    lastReset = resetRecord;
+    resetRecord.uptime = 0;
+    resetRecord.cause[0] = '\0';
+
+    // Also panics, so that the reset reason tells a hang from a crash
+    esp_task_wdt_init(WDT_TIMEOUT_S, true);
+    esp_task_wdt_add(nullptr);
+
+    supervisor.begin(millis(), resetRecord.boots);
+}
+
+
+// Whether an alarm rings or is snoozed: a reboot would lose it, as snoozes are only kept in memory
+bool alarmPending()
+{
+    for (int i = 0; i < n_alarms; i++)
+    {
+        if (snooze_until[i] != 0)
+        {
+            return true;
+        }
+    }
+    return ringing >= 0;
+}
+
+// Reset the board on behalf of a component that could not be recovered
+void softReset(const char *cause)
+{
+    // Never cut an alarm short, or an update
+    if (alarmPending() || ota.downloading())
+    {
+        return;
+    }
+    Serial.printf("Resetting, %s did not recover\n", cause);
+    strncpy(resetRecord.cause, cause, sizeof(resetRecord.cause) - 1);
+    resetRecord.uptime = millis() / 1000;
+    ESP.restart();
+}
+
+// Feed the watchdog and check on the components
+void supervisorStep()
+{
+    esp_task_wdt_reset();
+
+    unsigned long now = millis();
+    if (now - supervisorLast < SUPERVISOR_PERIOD_MS)
+    {
+        return;
+    }
+    supervisorLast = now;
+    resetRecord.uptime = now / 1000;
+
+    const Component *failed = supervisor.step(now);
+    if (failed != nullptr)
+    {
+        softReset(failed->name);
+    }
+}
+
+// Keep a freshly updated image on probation until it proves healthy (see otaCheckHealth())
+extern "C" bool verifyRollbackLater()
+{
+    return true;
+}
+
+// Find out whether this boot follows an update or a rollback
+void setupOta()
+{
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+        state == ESP_OTA_IMG_PENDING_VERIFY)
+    {
+        otaPendingVerify = true;
+        Serial.println("New firmware pending verification");
+    }
+    else if (esp_ota_get_last_invalid_partition() != nullptr)
+    {
+        otaBootStatus = "rolled back";
+    }
+}
+
+int BoardOtaPort::get(const char *url, size_t offset)
+{
+    http.end();
+    if (strncmp(url, "https:", 6) == 0)
+    {
+#ifdef MEDIBOX_MQTT_TLS
+        // Trust the same CA as the broker when there is one
+        if (certs != nullptr)
+        {
+            secureClient.setCACert(certs);
         }
         else
+#endif
         {
-            intensity = 1;
-            // Serial.print("Left LDR " + String(intensity) + " intensity");
-            AdjustServoMotor(intensity, 1.5);
+            // Only encrypts the transfer: the signature check is what vouches for the image
+            secureClient.setInsecure();
         }
+        http.begin(secureClient, url);
+    }
+    else
+    {
+        http.begin(plainClient, url);
     }
 
-    packet["Intensity"] = String(intensity);
-    serializeJson(packet, dataJson);
-    // Serial.println(dataJson);
+    if (offset > 0)
+    {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%u-", (unsigned)offset);
+        http.addHeader("Range", range);
+    }
 
-    mqttClient.publish("MQTT-LIGHT-INTENSITY", dataJson);
+    int code = http.GET();
+    if (code != HTTP_CODE_OK && code != HTTP_CODE_PARTIAL_CONTENT)
+    {
+        Serial.printf("OTA HTTP error %d\n", code);
+    }
+    return code;
 }
 
-// Adjust servo motor position based on light intensity and distance from minAngle
-void AdjustServoMotor(double lightintensity, double D)
+int BoardOtaPort::available()
 {
-    double angle = minAngle * D + (180.0 - minAngle) * lightintensity * controllingFac; // Calculate the angle based on light intensity
-    angle = min(angle, 180.0);
-    // Serial.println(" and new angle: " + String(angle) + "°");
-    motor.write(angle);
-    String(angle - 90, 2).toCharArray(motorAr, 6);
-    mqttClient.publish("MQTT-MOTOR-ANG", motorAr);
-}
\ No newline at end of file
+    WiFiClient *stream = http.getStreamPtr();
+    if (stream == nullptr || (!stream->connected() && stream->available() == 0))
+    {
+        return -1;
+    }
+    return stream->available();
+}
+
+size_t BoardOtaPort::read(uint8_t *buf, size_t size)
+{
+    return http.getStreamPtr()->readBytes(buf, size);
+}
+
+void BoardOtaPort::close()
+{
+    http.end();
+}
+
+size_t BoardOtaPort::partitionSize()
+{
+    partition = esp_ota_get_next_update_partition(nullptr);
+    return partition != nullptr ? partition->size : 0;
+}
+
+bool BoardOtaPort::begin()
+{
+    // Sequential writes erase the flash sector by sector instead of all at once up front
+    return esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &handle) == ESP_OK;
+}
+
+bool BoardOtaPort::write(const uint8_t *buf, size_t size)
+{
+    return esp_ota_write(handle, buf, size) == ESP_OK;
+}
+
+void BoardOtaPort::abort()
+{
+    esp_ota_abort(handle);
+    mbedtls_sha256_free(&sha);
+}
+
+bool BoardOtaPort::activate()
+{
+    return esp_ota_end(handle) == ESP_OK && esp_ota_set_boot_partition(partition) == ESP_OK;
+}
+
+void BoardOtaPort::hashStart()
+{
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+}
+
+void BoardOtaPort::hashUpdate(const uint8_t *buf, size_t size)
+{
+    mbedtls_sha256_update(&sha, buf, size);
+}
+
+bool BoardOtaPort::verify(const uint8_t *signature, size_t length)
+{
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+
+    mbedtls_pk_context key;
+    mbedtls_pk_init(&key);
+    bool valid = mbedtls_pk_parse_public_key(&key, (const unsigned char *)ota_public_key, sizeof(ota_public_key)) == 0 &&
+                 mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, digest, sizeof(digest), signature, length) == 0;
+    mbedtls_pk_free(&key);
+    return valid;
+}
+
+unsigned long BoardOtaPort::millis()
+{
+    return ::millis();
+}
+
+// Report the progress of an update
+void BoardOtaPort::status(const char *status)
+{
+    Serial.printf("OTA %s\n", status);
+    mqttClient.publish(deviceTopic("ota-status"), status);
+}
+
+// Start an update from JSON, e.g.
+// {"url":"http://192.168.1.10:8000/firmware.bin","size":912384,"sig":"<hex DER signature>"}
+// The signature is made with: openssl dgst -sha256 -sign ota_private.pem firmware.bin | xxd -p | tr -d '\n'
+void otaBegin(const char *json)
+{
+    // The partition to download into is the one set to boot
+    if (otaRestartPending)
+    {
+        otaPort.status("restart pending");
+        return;
+    }
+
+    JsonDocument doc;
+    DeserializationError error = deserializeJson(doc, json);
+    const char *url = doc["url"];
+    const char *sig = doc["sig"];
+    size_t size = doc["size"] | 0;
+    size_t sigLength = sig != nullptr ? strlen(sig) / 2 : 0;
+    if (error || url == nullptr || sig == nullptr || strlen(sig) % 2 != 0 || sigLength > OTA_MAX_SIGNATURE)
+    {
+        otaPort.status("invalid request");
+        return;
+    }
+
+    uint8_t signature[OTA_MAX_SIGNATURE];
+    for (size_t i = 0; i < sigLength; i++)
+    {
+        char hex[3] = {sig[i * 2], sig[i * 2 + 1], 0};
+        signature[i] = strtoul(hex, nullptr, 16);
+    }
+    ota.begin(url, size, signature, sigLength);
+}
+
+// Write the next chunk of the image, and reboot into it once it checks out
+// The reboot waits for a ringing or snoozed alarm, whose dose would otherwise be neither rung again nor logged
+void otaStep()
+{
+    if (ota.step())
+    {
+        otaRestartPending = true;
+    }
+    if (otaRestartPending && !alarmPending())
+    {
+        mqttClient.disconnect();
+        delay(100);
+        ESP.restart();
+    }
+}
+
+// Keep a new image once it reaches the broker, otherwise roll back to the previous one
+void otaCheckHealth()
+{
+    if (!otaPendingVerify)
+    {
+        return;
+    }
+
+    OtaHealth health = otaHealth(WiFi.status() == WL_CONNECTED && mqttClient.connected(), millis());
+    if (health == OTA_HEALTH_CONFIRM)
+    {
+        esp_ota_mark_app_valid_cancel_rollback();
+        otaPendingVerify = false;
+        otaPort.status("confirmed");
+    }
+    else if (health == OTA_HEALTH_ROLLBACK && !alarmPending())
+    {
+        Serial.println("New firmware unhealthy, rolling back");
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+}
+
+// Mount the file system holding traces and forget the previous input values
+void setupInputs()
+{
+    if (!LittleFS.begin(true))
+    {
+        Serial.println("LittleFS mount failed");
+    }
+    resetInputs();
+
+#ifdef MEDIBOX_REPLAY
+    traceStorage.file = LittleFS.open(TRACE_FILE, "r");
+    if (!traceStorage.file || !replayBegin(&traceStorage))
+    {
+        Serial.println("No trace to replay");
+        esp_task_wdt_delete(nullptr); // Stopping here is intended
+        for (;;)
+            delay(1000);
+    }
+    replayStarted = millis();
+#endif
+}
+
+size_t FileTrace::read(uint8_t *buf, size_t size)
+{
+    return file.read(buf, size);
+}
+
+size_t FileTrace::write(const uint8_t *buf, size_t size)
+{
+    return file.write(buf, size);
+}
+
+void FileTrace::flush()
+{
+    file.flush();
+}
+
+// Sensor and clock reads, recorded by inputs.h
+TempAndHumidity readTempAndHumidity()
+{
+    return dhtSensor.getTempAndHumidity();
+}
+
+int64_t readClockMs(int clock)
+{
+    if (clock == CLOCK_LOCAL)
+    {
+        struct timeval tv;
+        gettimeofday(&tv, nullptr);
+        return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+    }
+    timeClient.update();
+    return timeClient.getEpochTime() * 1000LL;
+}
+
+// Start recording a new trace, replacing the previous one
+void traceStart()
+{
+    if (tracing)
+    {
+        traceStop();
+    }
+
+    traceStorage.file = LittleFS.open(TRACE_FILE, "w");
+    if (!traceStorage.file)
+    {
+        Serial.println("Cannot create trace");
+        return;
+    }
+    traceBegin(&traceStorage, millis());
+    Serial.println("Trace started");
+}
+
+void traceStop()
+{
+    if (!tracing)
+    {
+        return;
+    }
+    traceEnd(millis());
+    Serial.printf("Trace stopped, %u bytes\n", (unsigned)traceStorage.file.size());
+    traceStorage.file.close();
+}
+
+// Flush the trace on time, and close it once it is full
+void traceCheck()
+{
+    if (!traceStep(millis()) && traceStorage.file)
+    {
+        Serial.printf("Trace full, stopped at %u bytes\n", (unsigned)traceStorage.file.size());
+        traceStorage.file.close();
+    }
+}
+
+// Print the trace as hex, to be turned back into a file with `xxd -r -p` or replayed as is
+void traceDump()
+{
+    if (tracing)
+    {
+        traceFlush(millis());
+    }
+
+    File file = LittleFS.open(TRACE_FILE, "r");
+    uint8_t chunk[32];
+    size_t n;
+    while (file && (n = file.read(chunk, sizeof(chunk))) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            Serial.printf("%02x", chunk[i]);
+        }
+        Serial.println();
+    }
+    file.close();
+}
+
+#ifdef MEDIBOX_REPLAY
+// Jump to the next deadline or recorded input, and stop once the whole trace has been fed
+void replayStep()
+{
+    if (!replayJump(nextDeadline(powerInputs())))
+    {
+        Serial.printf("Replay finished: %lu ms of trace in %lu ms\n", replayNow, millis() - replayStarted);
+        esp_task_wdt_delete(nullptr); // Stopping here is intended
+        for (;;)
+            delay(1000);
+    }
+}
+#endif
+
+// Runs in the web server's task: only queue the command, loop() carries it out
+void onWebSocketEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg,
+                      uint8_t *data, size_t len)
+{
+    if (type == WS_EVT_CONNECT)
+    {
+        webClientJoined = true;
+        return;
+    }
+    if (type != WS_EVT_DATA)
+    {
+        return;
+    }
+
+    // Commands are small single-frame text messages, e.g. {"cmd":"on-off","payload":"1"}
+    AwsFrameInfo *info = (AwsFrameInfo *)arg;
+    if (!info->final || info->index != 0 || info->len != len || info->opcode != WS_TEXT)
+    {
+        return;
+    }
+
+    JsonDocument doc;
+    if (deserializeJson(doc, data, len))
+    {
+        return;
+    }
+    const char *command = doc["cmd"];
+    const char *payload = doc["payload"] | "";
+    if (command == nullptr || strlen(command) >= TRACE_MAX_COMMAND || strlen(payload) > TRACE_MAX_PAYLOAD)
+    {
+        return;
+    }
+    if (!webCommandAllowed(command))
+    {
+        client->text(WEB_ERROR_NOT_ALLOWED);
+        return;
+    }
+
+    WebCommand webCommand;
+    strcpy(webCommand.command, command);
+    strcpy(webCommand.payload, payload);
+    if (xQueueSend(webCommands, &webCommand, 0) != pdTRUE)
+    {
+        client->text(WEB_ERROR_BUSY);
+    }
+}
+
+// Start serving the status page and the WebSocket
+void setupWeb()
+{
+    webCommands = xQueueCreate(WEB_QUEUE_LENGTH, sizeof(WebCommand));
+
+    webServer.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
+        AsyncWebServerResponse *response =
+            request->beginResponse_P(200, "text/html", status_page_gz, sizeof(status_page_gz));
+        response->addHeader("Content-Encoding", "gzip");
+        request->send(response);
+    });
+    webSocket.onEvent(onWebSocketEvent);
+    webServer.addHandler(&webSocket);
+    webServer.begin();
+}
+
+// Carry out the queued commands and push the state to the connected pages
+void webStep()
+{
+    WebCommand webCommand;
+    while (xQueueReceive(webCommands, &webCommand, 0) == pdTRUE)
+    {
+        Serial.printf("Web command [%s] %s\n", webCommand.command, webCommand.payload);
+        inputMessage(webCommand.command, webCommand.payload);
+        webClientJoined = true; // Show the outcome right away
+    }
+
+    if (webSocket.count() == 0 || (!webClientJoined && millis() - webPushLast < WEB_PUSH_PERIOD_MS))
+    {
+        return;
+    }
+    webPushLast = millis();
+    webClientJoined = false;
+
+    JsonDocument state;
+    state["temp"] = sensorData.temperature;
+    state["hum"] = sensorData.humidity;
+    state["light"] = (float)lightLevel / (INTENSITY_LEVELS - 1);
+    state["angle"] = servoAngle;
+    state["profile"] = String(activeProfile->params.id);
+    state["alarmsOn"] = alarm_enabled;
+    JsonArray alarms = state["alarms"].to<JsonArray>();
+    for (int i = 0; i < n_alarms; i++)
+    {
+        JsonArray alarm = alarms.add<JsonArray>();
+        alarm.add(alarm_hours[i]);
+        alarm.add(alarm_minutes[i]);
+        alarm.add(alarm_triggered[i]);
+    }
+
+    // Serialized straight into the buffer shared by every client, sized for the document
+    size_t length = measureJson(state);
+    AsyncWebSocketMessageBuffer *buffer = webSocket.makeBuffer(length);
+    if (buffer == nullptr)
+    {
+        return;
+    }
+    serializeJson(state, (char *)buffer->get(), length + 1);
+    webSocket.textAll(buffer);
+    webSocket.cleanupClients();
+}
@@ -0,0 +1,94 @@
+// Status page served by the local web server, gzipped from web/status.html
+// Regenerate the array after editing the page with: gzip -9 -n -c web/status.html | xxd -i
+#pragma once
+
+#include <Arduino.h>
+
+const uint8_t status_page_gz[] PROGMEM = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x8d, 0x96,
+  0x5d, 0x8e, 0xdb, 0x36, 0x10, 0x80, 0xdf, 0x7d, 0x0a, 0x55, 0xf9, 0xa1,
+  0x54, 0xeb, 0xc7, 0x36, 0x8a, 0x62, 0x21, 0x4b, 0x5a, 0xec, 0x3a, 0x29,
+  0xda, 0x22, 0xed, 0x06, 0xd8, 0x05, 0xda, 0x22, 0xc8, 0x03, 0x57, 0xa4,
+  0x6c, 0x36, 0x14, 0x29, 0x88, 0x94, 0x65, 0xc7, 0xf0, 0x29, 0xfa, 0xda,
+  0x43, 0xe4, 0x0c, 0x39, 0x4a, 0x4f, 0xd2, 0xa1, 0x24, 0xab, 0xb6, 0xe3,
+  0x45, 0xf3, 0x44, 0x69, 0xf8, 0xcd, 0x0c, 0x67, 0x46, 0x33, 0x54, 0xfc,
+  0xcd, 0xab, 0xbb, 0xc5, 0xc3, 0x1f, 0x6f, 0x5f, 0x5b, 0x2b, 0x5d, 0xf0,
+  0x74, 0x14, 0x1f, 0x16, 0x8a, 0x09, 0x2c, 0x05, 0xd5, 0xd8, 0xca, 0x56,
+  0xb8, 0x52, 0x54, 0x27, 0x76, 0xad, 0x73, 0xff, 0xca, 0x3e, 0x88, 0x05,
+  0x2e, 0x68, 0x62, 0xaf, 0x19, 0x6d, 0x4a, 0x59, 0x69, 0xdb, 0xca, 0xa4,
+  0xd0, 0x54, 0x00, 0xd6, 0x30, 0xa2, 0x57, 0x09, 0xa1, 0x6b, 0x96, 0x51,
+  0xbf, 0x7d, 0xf1, 0x98, 0x60, 0x9a, 0x61, 0xee, 0xab, 0x0c, 0x73, 0x9a,
+  0x4c, 0x8d, 0x0d, 0xcd, 0x34, 0xa7, 0xe9, 0x2f, 0x94, 0xb0, 0x5b, 0xb9,
+  0x89, 0xc3, 0xee, 0x75, 0x14, 0x2b, 0xbd, 0x35, 0xeb, 0xa3, 0x24, 0xdb,
+  0x5d, 0x0e, 0x16, 0xfd, 0x1c, 0x17, 0x8c, 0x6f, 0x23, 0x85, 0x85, 0xf2,
+  0x15, 0xad, 0x58, 0x3e, 0x2f, 0xf0, 0xa6, 0x33, 0x1b, 0x7d, 0x37, 0x9b,
+  0x94, 0x1b, 0x78, 0xaf, 0x96, 0x4c, 0x44, 0xb8, 0xd6, 0x72, 0x5e, 0x62,
+  0x42, 0x98, 0x58, 0x46, 0x57, 0xe5, 0x66, 0x3f, 0xd2, 0xf8, 0x91, 0xd3,
+  0x5d, 0x87, 0x4e, 0x27, 0x93, 0x17, 0x7b, 0x4d, 0x22, 0x8e, 0x95, 0xf6,
+  0xb3, 0x15, 0xe3, 0x64, 0xa7, 0xe9, 0x46, 0xfb, 0x98, 0xb3, 0xa5, 0x88,
+  0x2a, 0xb6, 0x5c, 0xe9, 0x79, 0xeb, 0xaf, 0xa1, 0xe6, 0x39, 0x7a, 0x94,
+  0x9c, 0xec, 0x47, 0x8f, 0xb5, 0xd6, 0x52, 0x78, 0x8a, 0x72, 0x9a, 0xe9,
+  0x5d, 0xef, 0x68, 0x06, 0x3e, 0x0f, 0x7e, 0xbe, 0x37, 0x7e, 0x9e, 0x29,
+  0x8d, 0x35, 0xdd, 0x65, 0x92, 0xcb, 0x2a, 0x7a, 0x76, 0x75, 0x75, 0xb5,
+  0x1f, 0xc5, 0x61, 0x1f, 0x48, 0x1c, 0xf6, 0xa9, 0x34, 0x11, 0x99, 0xc4,
+  0xce, 0x0e, 0x31, 0x5b, 0xb1, 0x2a, 0xb1, 0xb0, 0x18, 0x49, 0xec, 0x56,
+  0xdf, 0x4e, 0x65, 0x9e, 0x73, 0x26, 0x28, 0xe8, 0xc2, 0x46, 0x0a, 0x9a,
+  0x33, 0x93, 0x27, 0x13, 0x84, 0x59, 0xab, 0x34, 0xd6, 0x24, 0x7d, 0xa0,
+  0x45, 0x49, 0x2b, 0xac, 0xeb, 0x0a, 0x38, 0x78, 0x07, 0x59, 0x6b, 0x42,
+  0x83, 0xdc, 0x4e, 0xfd, 0x4e, 0x16, 0x02, 0x3c, 0x68, 0xfc, 0x58, 0x17,
+  0x8c, 0x30, 0xbd, 0x3d, 0xc1, 0x57, 0x75, 0x71, 0x99, 0x7e, 0x63, 0xa2,
+  0x3f, 0x41, 0xb9, 0x91, 0x5c, 0x86, 0xef, 0x69, 0xb5, 0x96, 0x16, 0x16,
+  0x4b, 0x7e, 0x7a, 0x98, 0x56, 0x72, 0x59, 0xe5, 0x6d, 0x25, 0x73, 0x76,
+  0x86, 0x97, 0x9d, 0xec, 0xb2, 0xc2, 0x0d, 0xc7, 0x55, 0xa1, 0x4e, 0xcd,
+  0xb7, 0xa2, 0x33, 0x3c, 0x3c, 0x24, 0xaa, 0x4c, 0x47, 0xb7, 0xf5, 0xc7,
+  0x8f, 0xb4, 0xb2, 0xe2, 0xae, 0x7c, 0x96, 0x14, 0x19, 0x67, 0xd9, 0x07,
+  0xc8, 0x33, 0x15, 0xc4, 0x41, 0x52, 0xf8, 0x90, 0x69, 0xe4, 0xa1, 0x29,
+  0x72, 0xed, 0xf4, 0x4e, 0xc4, 0x61, 0xc7, 0xa5, 0xff, 0xc7, 0x4f, 0x5a,
+  0x3e, 0xcf, 0x07, 0x05, 0xf0, 0x5a, 0x76, 0x1e, 0xfb, 0xb0, 0xa0, 0xa6,
+  0xed, 0xa7, 0xd2, 0x55, 0xb5, 0x7d, 0xb4, 0x8d, 0xb9, 0x15, 0x64, 0x84,
+  0x1e, 0xec, 0x91, 0x4a, 0x96, 0x3e, 0x91, 0x8d, 0x40, 0x9e, 0x5e, 0x31,
+  0x15, 0xac, 0x31, 0xaf, 0xa9, 0x6b, 0x7a, 0x42, 0x96, 0x9a, 0x81, 0xff,
+  0x56, 0x90, 0xd8, 0xaf, 0xec, 0xf4, 0x5e, 0x63, 0x41, 0x70, 0x45, 0xe2,
+  0xb0, 0xdb, 0x4a, 0xcf, 0x90, 0x1b, 0x3b, 0x7d, 0x30, 0x61, 0x6b, 0xeb,
+  0x66, 0x40, 0xce, 0xcd, 0xdc, 0x0e, 0xcc, 0xed, 0x53, 0x66, 0x16, 0x03,
+  0xb2, 0x78, 0x0a, 0xf9, 0xdd, 0x4e, 0x17, 0xb5, 0xd2, 0xb2, 0x38, 0xf2,
+  0x13, 0x76, 0x11, 0x1e, 0xa5, 0xe1, 0x8d, 0x6c, 0xac, 0x52, 0x36, 0x4f,
+  0xe7, 0x9e, 0xcb, 0xc6, 0x6f, 0x81, 0xaf, 0x4f, 0xff, 0xb1, 0xca, 0x53,
+  0x15, 0x50, 0x59, 0xc5, 0x4a, 0x38, 0xc8, 0x1a, 0x57, 0x56, 0xa3, 0xe6,
+  0xa3, 0xbc, 0x16, 0x59, 0x7b, 0xfa, 0xe7, 0x0e, 0x23, 0xee, 0xae, 0xa2,
+  0xd0, 0x2f, 0xc2, 0x22, 0x32, 0xab, 0x0b, 0x18, 0x51, 0xc1, 0x92, 0xea,
+  0xd7, 0x9c, 0x9a, 0xc7, 0xdb, 0xed, 0x4f, 0xc4, 0x20, 0xfb, 0xff, 0x54,
+  0x44, 0x5d, 0x38, 0x6b, 0x8f, 0xb0, 0x25, 0xd3, 0xca, 0xab, 0x61, 0x70,
+  0x0d, 0xfa, 0xeb, 0x24, 0x11, 0x35, 0xe7, 0xd7, 0xc8, 0x47, 0xd1, 0x3a,
+  0xd0, 0xf2, 0x07, 0xb6, 0xa1, 0xc4, 0xe9, 0x48, 0x77, 0x6c, 0xd0, 0x23,
+  0x33, 0xed, 0xe1, 0xb3, 0x82, 0x78, 0x25, 0xde, 0x72, 0x89, 0xe1, 0x14,
+  0x2c, 0x77, 0x1a, 0xf5, 0xf2, 0x65, 0xa3, 0x82, 0x0a, 0x46, 0xc2, 0xf6,
+  0xde, 0x34, 0x7d, 0x92, 0x4c, 0x5d, 0x10, 0xb4, 0xf0, 0xcf, 0xf7, 0x77,
+  0xbf, 0x06, 0x4a, 0x57, 0x30, 0x57, 0x58, 0xbe, 0x75, 0x76, 0xa0, 0x1c,
+  0x1d, 0x19, 0x88, 0xfa, 0x75, 0xef, 0x1e, 0x9f, 0x16, 0xa6, 0xae, 0x80,
+  0x1a, 0x38, 0xee, 0x6e, 0x04, 0x91, 0x27, 0x82, 0x36, 0xd6, 0x6f, 0xf4,
+  0xf1, 0x5e, 0x66, 0x1f, 0xa8, 0x76, 0x50, 0xa3, 0xa2, 0x30, 0x44, 0x63,
+  0x2e, 0x33, 0x6c, 0xe8, 0x60, 0x25, 0x95, 0x1e, 0xa3, 0xb0, 0x51, 0xc8,
+  0x9d, 0x1b, 0x3e, 0x90, 0x42, 0x96, 0x54, 0x24, 0x07, 0x73, 0x60, 0xe6,
+  0xb9, 0x83, 0xda, 0x71, 0x84, 0xdc, 0xc0, 0x0c, 0xc8, 0x45, 0x3f, 0xd5,
+  0x11, 0x67, 0x6b, 0x8a, 0xf6, 0x07, 0xad, 0x8c, 0x4b, 0x45, 0xbf, 0x46,
+  0xad, 0x9f, 0x69, 0x68, 0x0e, 0x37, 0xc8, 0x03, 0x2b, 0xa8, 0xac, 0xb5,
+  0xd3, 0x9f, 0xd9, 0x9b, 0x4d, 0x26, 0x13, 0x77, 0x30, 0x59, 0x50, 0xa5,
+  0xf0, 0xf2, 0xc8, 0x28, 0x35, 0x31, 0x59, 0xa6, 0xa4, 0x2a, 0x69, 0x73,
+  0x53, 0x9a, 0x7b, 0xc8, 0xa1, 0x01, 0xc1, 0x1a, 0x9b, 0xf3, 0x43, 0x75,
+  0x91, 0x99, 0x7b, 0x67, 0x3e, 0x4d, 0x01, 0x55, 0x60, 0x36, 0xbc, 0xa9,
+  0x87, 0xac, 0xcf, 0x9f, 0x16, 0xe8, 0x40, 0xc3, 0xd8, 0xbb, 0x08, 0x83,
+  0xbc, 0x65, 0x5f, 0x0c, 0x64, 0x3b, 0xf5, 0x2e, 0xb2, 0xed, 0xce, 0xb7,
+  0x70, 0x9f, 0x78, 0x93, 0x13, 0x8d, 0x76, 0xe8, 0x9d, 0x69, 0xa8, 0xa0,
+  0x95, 0x8e, 0xd1, 0xe7, 0x4f, 0xa8, 0xc7, 0xfa, 0x61, 0xf7, 0x05, 0xd8,
+  0xcb, 0x7b, 0xaa, 0xeb, 0x2c, 0x80, 0xba, 0xf6, 0x3b, 0xdf, 0xee, 0x26,
+  0xe0, 0x97, 0xce, 0x5a, 0xf1, 0x9d, 0xb8, 0x3e, 0x3c, 0x06, 0x05, 0x2e,
+  0x9d, 0x21, 0xa1, 0x78, 0xf8, 0x92, 0x1d, 0xe8, 0xa4, 0x31, 0x7e, 0x37,
+  0x79, 0xef, 0x06, 0x0a, 0x7a, 0x8d, 0x3a, 0xfe, 0xcc, 0x1d, 0xa3, 0x08,
+  0x8d, 0xfb, 0x8d, 0xe9, 0xc9, 0x86, 0x83, 0xdf, 0xcd, 0xde, 0x5f, 0x23,
+  0xeb, 0x9f, 0xbf, 0xff, 0x02, 0x06, 0xb9, 0x7b, 0x37, 0xf8, 0x53, 0x32,
+  0xe1, 0x20, 0xcf, 0x42, 0x6e, 0x84, 0x08, 0x53, 0x66, 0x78, 0x10, 0x13,
+  0x21, 0x54, 0x73, 0x3f, 0x1a, 0xbe, 0xc9, 0xb9, 0x99, 0x11, 0x7d, 0x6b,
+  0x42, 0xcb, 0x76, 0x37, 0x60, 0xd8, 0xfd, 0x62, 0xfc, 0x0b, 0xe5, 0x9c,
+  0xf0, 0x7f, 0x7a, 0x08, 0x00, 0x00
+};
@@ -0,0 +1,133 @@
+// Supervisor
+// Every SUPERVISOR_PERIOD_MS the supervisor checks each component. One that has not been healthy for its
+// timeout gets its next recovery step, and once the steps run out the last one is retried at longer and
+// longer intervals. The board is only reset for a fault inside the device, which a reset can cure, and it
+// waits longer the more resets there were since power on, so a fault a reset does not cure cannot keep
+// the board rebooting. The fault must look internal at every check for a whole timeout before a reset,
+// so a status caught between two attempts cannot cause one. The task watchdog covers loop() itself.
+// The components' checks are passed in, so the supervisor also runs on the host.
+#pragma once
+
+#include <stdint.h>
+
+#define SUPERVISOR_PERIOD_MS 1000
+#define SUPERVISOR_MAX_COMPONENTS 8
+#define SUPERVISOR_MAX_RETRY_MS 600000UL // Longest wait between retries of the last recovery step
+#define SUPERVISOR_MAX_BACKOFF 5         // Resets wait up to 2^5 times as long after earlier resets
+
+// Timeouts and recovery steps of the sketch's components
+#define DISPLAY_TIMEOUT_MS 10000
+#define DISPLAY_STEPS 1 // Reinitialise
+#define WIFI_TIMEOUT_MS 60000
+#define WIFI_STEPS 2 // Reconnect, restart the driver
+#define MQTT_TIMEOUT_MS 120000
+#define MQTT_STEPS 1 // Connect from scratch
+
+struct Component
+{
+    const char *name;
+    unsigned long timeoutMs; // Time without a heartbeat before each recovery step
+    int steps;               // Recovery steps, the last one is retried after them
+    bool (*healthy)();
+    void (*recover)(int step);
+    bool (*internalFault)(); // Whether the fault is in the device so a reset may cure it, nullptr if never
+};
+
+class Supervisor
+{
+public:
+    Supervisor(const Component *components, int count) : components(components), count(count)
+    {
+    }
+
+    // boots is the number of resets since power on
+    void begin(unsigned long now, uint32_t boots)
+    {
+        this->boots = boots < SUPERVISOR_MAX_BACKOFF ? boots : SUPERVISOR_MAX_BACKOFF;
+        for (int i = 0; i < count; i++)
+        {
+            heartbeat[i] = now;
+            next[i] = now + components[i].timeoutMs;
+            taken[i] = 0;
+            internal[i] = false;
+        }
+    }
+
+    // Check on the components, once a period
+    // Returns the component to reset the board for, or nullptr
+    const Component *step(unsigned long now)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            const Component &component = components[i];
+            if (component.healthy())
+            {
+                heartbeat[i] = now;
+                next[i] = now + component.timeoutMs;
+                taken[i] = 0;
+                internal[i] = false;
+                continue;
+            }
+
+            bool wasInternal = internal[i];
+            internal[i] = component.internalFault != nullptr && component.internalFault();
+            if (internal[i] && !wasInternal)
+            {
+                internalSince[i] = now;
+            }
+            if (taken[i] >= component.steps && internal[i] && now - heartbeat[i] >= resetAfter(component) &&
+                now - internalSince[i] >= component.timeoutMs)
+            {
+                return &component;
+            }
+
+            if ((long)(now - next[i]) < 0)
+            {
+                continue;
+            }
+            int step = taken[i] < component.steps ? taken[i] : component.steps - 1;
+            component.recover(step);
+            taken[i]++;
+            next[i] = now + retryAfter(component, taken[i]);
+        }
+        return nullptr;
+    }
+
+    // Time a component has to be down before the board is reset for it
+    unsigned long resetAfter(const Component &component) const
+    {
+        return component.timeoutMs * (component.steps + 1) << boots;
+    }
+
+    // Recovery steps taken since a component was last healthy
+    int stepsTaken(int i) const
+    {
+        return taken[i];
+    }
+
+private:
+    // Wait after the given number of steps: a timeout for each step, doubling for each retry after them
+    static unsigned long retryAfter(const Component &component, int taken)
+    {
+        int retries = taken - component.steps;
+        if (retries <= 0)
+        {
+            return component.timeoutMs;
+        }
+        unsigned long wait = component.timeoutMs;
+        for (int i = 0; i < retries && wait < SUPERVISOR_MAX_RETRY_MS; i++)
+        {
+            wait *= 2;
+        }
+        return wait < SUPERVISOR_MAX_RETRY_MS ? wait : SUPERVISOR_MAX_RETRY_MS;
+    }
+
+    const Component *components;
+    int count;
+    uint32_t boots = 0;
+    unsigned long heartbeat[SUPERVISOR_MAX_COMPONENTS];
+    unsigned long next[SUPERVISOR_MAX_COMPONENTS];
+    int taken[SUPERVISOR_MAX_COMPONENTS];
+    bool internal[SUPERVISOR_MAX_COMPONENTS];               // The fault looked internal at the last check
+    unsigned long internalSince[SUPERVISOR_MAX_COMPONENTS]; // Since when it has at every check
+};
@@ -0,0 +1,342 @@
+#include "tls_client.h"
+
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/version.h>
+
+// Session fields are private from mbedTLS 3 on
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define SESSION_FIELD(field) MBEDTLS_PRIVATE(field)
+#else
+#define SESSION_FIELD(field) field
+#endif
+
+TlsClient::TlsClient()
+{
+    mbedtls_ssl_init(&ssl);
+    mbedtls_ssl_config_init(&conf);
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_x509_crt_init(&caCert);
+    mbedtls_x509_crt_init(&ownCert);
+    mbedtls_pk_init(&ownKey);
+    mbedtls_ssl_session_init(&session);
+}
+
+TlsClient::~TlsClient()
+{
+    stop();
+    mbedtls_ssl_session_free(&session);
+    mbedtls_pk_free(&ownKey);
+    mbedtls_x509_crt_free(&ownCert);
+    mbedtls_x509_crt_free(&caCert);
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+    mbedtls_ssl_config_free(&conf);
+    mbedtls_ssl_free(&ssl);
+}
+
+bool TlsClient::setCACert(const char *ca)
+{
+    return mbedtls_x509_crt_parse(&caCert, (const unsigned char *)ca, strlen(ca) + 1) == 0;
+}
+
+bool TlsClient::setCertificate(const char *cert, const char *key)
+{
+    if (mbedtls_x509_crt_parse(&ownCert, (const unsigned char *)cert, strlen(cert) + 1) != 0)
+    {
+        return false;
+    }
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+    int ret = mbedtls_pk_parse_key(&ownKey, (const unsigned char *)key, strlen(key) + 1, nullptr, 0,
+                                   mbedtls_ctr_drbg_random, &drbg);
+#else
+    int ret = mbedtls_pk_parse_key(&ownKey, (const unsigned char *)key, strlen(key) + 1, nullptr, 0);
+#endif
+    hasOwnCert = ret == 0;
+    return hasOwnCert;
+}
+
+void TlsClient::setHandshakeTimeout(unsigned long ms)
+{
+    timeoutMs = ms;
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port)
+{
+    return connect(ip.toString().c_str(), port);
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+    return connect(ip.toString().c_str(), port, timeout);
+}
+
+int TlsClient::connect(const char *host, uint16_t port)
+{
+    return connect(host, port, (int32_t)timeoutMs);
+}
+
+// The timeout (ms) bounds the TCP connection and the handshake together
+int TlsClient::connect(const char *host, uint16_t port, int32_t timeout)
+{
+    stop();
+
+    // The configuration is shared by all connections, only set it up once
+    if (!ready)
+    {
+        if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, nullptr, 0) != 0 ||
+            mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                        MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+        {
+            return 0;
+        }
+        mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&conf, &caCert, nullptr);
+        mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+        mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+        if (hasOwnCert && mbedtls_ssl_conf_own_cert(&conf, &ownCert, &ownKey) != 0)
+        {
+            return 0;
+        }
+        ready = true;
+    }
+
+    heapBefore = ESP.getFreeHeap();
+    heapLowest = heapBefore;
+    unsigned long start = millis();
+
+    if (!tcp.connect(host, port, timeout))
+    {
+        return 0;
+    }
+    if (mbedtls_ssl_setup(&ssl, &conf) != 0 || mbedtls_ssl_set_hostname(&ssl, host) != 0)
+    {
+        stop();
+        return 0;
+    }
+    mbedtls_ssl_set_bio(&ssl, this, sendCallback, recvCallback, nullptr);
+    if (hasSession)
+    {
+        mbedtls_ssl_set_session(&ssl, &session);
+    }
+
+    int ret;
+    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0)
+    {
+        sampleHeap();
+        if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) || millis() - start > (unsigned long)timeout)
+        {
+            Serial.printf("TLS handshake failed: -0x%04x\n", -ret);
+            // The session may be what the server rejected
+            forgetSession();
+            stop();
+            return 0;
+        }
+        delay(1);
+    }
+    lastHandshakeMs = millis() - start;
+
+    // A resumed session keeps its master secret, a full handshake derives a new one
+    // The session id tells nothing with tickets, the client makes up a new one every time it offers a ticket
+    mbedtls_ssl_session current;
+    mbedtls_ssl_session_init(&current);
+    lastResumed = false;
+    if (mbedtls_ssl_get_session(&ssl, &current) == 0)
+    {
+        lastResumed = hasSession && memcmp(current.SESSION_FIELD(master), session.SESSION_FIELD(master),
+                                           sizeof(session.SESSION_FIELD(master))) == 0;
+        mbedtls_ssl_session_free(&session);
+        session = current;
+        hasSession = true;
+    }
+    else
+    {
+        mbedtls_ssl_session_free(&current);
+    }
+
+    established = true;
+    return 1;
+}
+
+size_t TlsClient::write(uint8_t b)
+{
+    return write(&b, 1);
+}
+
+size_t TlsClient::write(const uint8_t *buf, size_t size)
+{
+    if (!established)
+    {
+        return 0;
+    }
+
+    size_t written = 0;
+    while (written < size)
+    {
+        int ret = mbedtls_ssl_write(&ssl, buf + written, size - written);
+        if (ret > 0)
+        {
+            written += ret;
+        }
+        else if (ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret != MBEDTLS_ERR_SSL_WANT_READ)
+        {
+            stop();
+            break;
+        }
+    }
+    return written;
+}
+
+int TlsClient::available()
+{
+    if (!established)
+    {
+        return 0;
+    }
+
+    // Let mbedTLS decrypt a pending record, if any, before asking how much data it holds
+    int ret = mbedtls_ssl_read(&ssl, nullptr, 0);
+    if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+        stop();
+        return peeked >= 0 ? 1 : 0;
+    }
+    return mbedtls_ssl_get_bytes_avail(&ssl) + (peeked >= 0 ? 1 : 0);
+}
+
+int TlsClient::read()
+{
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int TlsClient::read(uint8_t *buf, size_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    int offset = 0;
+    if (peeked >= 0)
+    {
+        buf[offset++] = peeked;
+        peeked = -1;
+        if (size == 1)
+        {
+            return 1;
+        }
+    }
+    if (!established)
+    {
+        return offset > 0 ? offset : -1;
+    }
+
+    int ret = mbedtls_ssl_read(&ssl, buf + offset, size - offset);
+    if (ret > 0)
+    {
+        return offset + ret;
+    }
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+        stop();
+    }
+    return offset > 0 ? offset : -1;
+}
+
+int TlsClient::peek()
+{
+    if (peeked < 0)
+    {
+        uint8_t b;
+        if (established && mbedtls_ssl_read(&ssl, &b, 1) == 1)
+        {
+            peeked = b;
+        }
+    }
+    return peeked;
+}
+
+void TlsClient::flush()
+{
+}
+
+void TlsClient::stop()
+{
+    if (established)
+    {
+        mbedtls_ssl_close_notify(&ssl);
+    }
+    established = false;
+    peeked = -1;
+    tcp.stop();
+    mbedtls_ssl_free(&ssl);
+    mbedtls_ssl_init(&ssl);
+}
+
+uint8_t TlsClient::connected()
+{
+    return established && (tcp.connected() || available() > 0);
+}
+
+TlsClient::operator bool()
+{
+    return connected();
+}
+
+unsigned long TlsClient::handshakeMs() const
+{
+    return lastHandshakeMs;
+}
+
+size_t TlsClient::handshakeHeap() const
+{
+    return heapBefore - heapLowest;
+}
+
+bool TlsClient::resumed() const
+{
+    return lastResumed;
+}
+
+void TlsClient::forgetSession()
+{
+    mbedtls_ssl_session_free(&session);
+    mbedtls_ssl_session_init(&session);
+    hasSession = false;
+}
+
+void TlsClient::sampleHeap()
+{
+    size_t heap = ESP.getFreeHeap();
+    if (heap < heapLowest)
+    {
+        heapLowest = heap;
+    }
+}
+
+int TlsClient::sendCallback(void *ctx, const unsigned char *buf, size_t len)
+{
+    TlsClient *client = (TlsClient *)ctx;
+    client->sampleHeap();
+    if (!client->tcp.connected())
+    {
+        return MBEDTLS_ERR_NET_CONN_RESET;
+    }
+    size_t sent = client->tcp.write(buf, len);
+    return sent > 0 ? (int)sent : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+int TlsClient::recvCallback(void *ctx, unsigned char *buf, size_t len)
+{
+    TlsClient *client = (TlsClient *)ctx;
+    client->sampleHeap();
+    if (client->tcp.available() <= 0)
+    {
+        return client->tcp.connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+    }
+    int received = client->tcp.read(buf, len);
+    return received > 0 ? received : MBEDTLS_ERR_SSL_WANT_READ;
+}
@@ -0,0 +1,72 @@
+// TLS client for the MQTT connection
+// Unlike WiFiClientSecure it keeps the TLS session of the last connection and offers it again on
+// reconnect, so the server can resume it (session id or ticket) instead of a full handshake
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+
+class TlsClient : public Client
+{
+public:
+    TlsClient();
+    ~TlsClient();
+
+    // PEM certificates, they must outlive the client
+    bool setCACert(const char *ca);
+    bool setCertificate(const char *cert, const char *key);
+    void setHandshakeTimeout(unsigned long ms); // Default for a connect() without a timeout
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(IPAddress ip, uint16_t port, int32_t timeout);
+    int connect(const char *host, uint16_t port);
+    int connect(const char *host, uint16_t port, int32_t timeout);
+    size_t write(uint8_t b);
+    size_t write(const uint8_t *buf, size_t size);
+    int available();
+    int read();
+    int read(uint8_t *buf, size_t size);
+    int peek();
+    void flush();
+    void stop();
+    uint8_t connected();
+    operator bool();
+
+    // Cost of the last handshake
+    unsigned long handshakeMs() const;
+    size_t handshakeHeap() const; // Peak heap used during the handshake, sampled
+    bool resumed() const;         // Whether the last handshake resumed the previous session
+
+    void forgetSession();
+
+private:
+    static int sendCallback(void *ctx, const unsigned char *buf, size_t len);
+    static int recvCallback(void *ctx, unsigned char *buf, size_t len);
+    void sampleHeap();
+
+    WiFiClient tcp;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_x509_crt caCert;
+    mbedtls_x509_crt ownCert;
+    mbedtls_pk_context ownKey;
+    mbedtls_ssl_session session;
+
+    bool ready = false;      // Config set up
+    bool hasSession = false; // A session is kept for the next connection
+    bool hasOwnCert = false;
+    bool established = false;
+    int peeked = -1;
+    unsigned long timeoutMs = 10000;
+    unsigned long lastHandshakeMs = 0;
+    size_t heapBefore = 0;
+    size_t heapLowest = 0;
+    bool lastResumed = false;
+};
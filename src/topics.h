@@ -0,0 +1,43 @@
+// Device identity and MQTT topics
+// Each box publishes under medibox/<id>/ and takes commands on medibox/<id>/cmd/<command>,
+// or on medibox/all/cmd/<command> for the whole fleet
+// Shared with the host tools that stand in for a fleet of boxes
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TOPIC_ROOT "medibox"
+#define GROUP_ID "all"
+#define DEVICE_ID_SIZE 13 // Six bytes of MAC address in hex
+
+// Device id from the eFuse MAC address, lowest byte first like ESP.getEfuseMac() returns it
+inline void formatDeviceId(char *deviceId, uint64_t mac)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        snprintf(deviceId + i * 2, 3, "%02x", (int)(mac >> (i * 8)) & 0xff);
+    }
+}
+
+inline void formatClientId(char *clientId, size_t size, const char *deviceId)
+{
+    snprintf(clientId, size, "medibox-%s", deviceId);
+}
+
+// Full topic of one of a device's messages, e.g. medibox/<id>/temp or medibox/<id>/cmd/#
+inline const char *formatTopic(char *topic, size_t size, const char *deviceId, const char *name)
+{
+    snprintf(topic, size, TOPIC_ROOT "/%s/%s", deviceId, name);
+    return topic;
+}
+
+// The command a topic carries, or nullptr if it is not a command
+// Both a device's own and the fleet's commands end in /cmd/<command>
+inline const char *topicCommand(const char *topic)
+{
+    const char *command = strstr(topic, "/cmd/");
+    return command != nullptr ? command + strlen("/cmd/") : nullptr;
+}
@@ -0,0 +1,23 @@
+// Commands the local status page may send over its WebSocket
+// The page has no authentication, so anyone on the LAN can use it: only the readings and the
+// controls on the page are allowed, firmware updates, tracing and the dose log go through MQTT
+// Shared with the host benchmark that checks the allowlist on a running box
+#pragma once
+
+#include <string.h>
+
+#define WEB_ERROR_NOT_ALLOWED "{\"error\":\"not allowed\"}"
+#define WEB_ERROR_BUSY "{\"error\":\"busy\"}"
+
+inline bool webCommandAllowed(const char *command)
+{
+    static const char *const allowed[] = {"on-off", "sch-on", "min-ang", "ctrl-fac", "drop-down", "low-power"};
+    for (const char *name : allowed)
+    {
+        if (strcmp(command, name) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,34 @@
+// Minimal checks for the host tests, reporting every failure and failing the run at the end
+#pragma once
+
+#include <stdio.h>
+
+static int check_failures = 0;
+
+#define CHECK(cond)                                                          \
+    do                                                                       \
+    {                                                                        \
+        if (!(cond))                                                         \
+        {                                                                    \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);  \
+            check_failures++;                                                \
+        }                                                                    \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                       \
+    do                                                                                       \
+    {                                                                                        \
+        long long check_a = (long long)(a), check_b = (long long)(b);                        \
+        if (check_a != check_b)                                                              \
+        {                                                                                    \
+            printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, \
+                   #b, check_a, check_b);                                                    \
+            check_failures++;                                                                \
+        }                                                                                    \
+    } while (0)
+
+static int check_result(const char *name)
+{
+    printf("%s: %s\n", name, check_failures == 0 ? "passed" : "FAILED");
+    return check_failures == 0 ? 0 : 1;
+}
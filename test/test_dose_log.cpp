@@ -0,0 +1,434 @@
+// Dose log on a file standing in for the doselog partition, with power cut in the middle of writes and erases
+#include "check.h"
+
+#include "dose_log.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// A file behaving like flash: erasing sets 0xFF and writing can only clear bits
+// The power can be cut after a number of bytes, leaving the write or erase half done
+class HostDoseStorage : public DoseStorage
+{
+public:
+    // Room for sectors of records, after the sector holding the magic
+    explicit HostDoseStorage(int sectors) : sectors(sectors + 1)
+    {
+        strcpy(path, "/tmp/test_dose_log_XXXXXX");
+        fd = mkstemp(path);
+        uint8_t erased[DOSE_SECTOR_SIZE];
+        memset(erased, 0xFF, sizeof(erased));
+        for (int i = 0; i < sectors; i++)
+        {
+            ::write(fd, erased, sizeof(erased));
+        }
+    }
+
+    ~HostDoseStorage()
+    {
+        close(fd);
+        unlink(path);
+    }
+
+    // The next write or erase stops after this many bytes, and so does everything after it
+    void cutPowerAfter(long bytes)
+    {
+        powerLeft = bytes;
+    }
+
+    // Boot again with the power back
+    void restore()
+    {
+        powerLeft = -1;
+    }
+
+    size_t size()
+    {
+        return sectors * DOSE_SECTOR_SIZE;
+    }
+
+    bool read(size_t offset, void *buf, size_t size)
+    {
+        return pread(fd, buf, size, offset) == (ssize_t)size;
+    }
+
+    bool write(size_t offset, const void *buf, size_t size)
+    {
+        writes++;
+        uint8_t old[sizeof(DoseRecord)];
+        const uint8_t *bytes = (const uint8_t *)buf;
+        for (size_t done = 0; done < size; done += sizeof(old))
+        {
+            size_t n = size - done < sizeof(old) ? size - done : sizeof(old);
+            pread(fd, old, n, offset + done);
+            for (size_t i = 0; i < n; i++)
+            {
+                // Flash cannot set a bit back to 1 without an erase
+                if ((old[i] & bytes[done + i]) != bytes[done + i])
+                {
+                    overwrites++;
+                }
+                old[i] &= bytes[done + i];
+            }
+            size_t allowed = spend(n);
+            pwrite(fd, old, allowed, offset + done);
+            if (allowed < n)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool erase(size_t offset, size_t size)
+    {
+        erases++;
+        uint8_t erased[256];
+        memset(erased, 0xFF, sizeof(erased));
+        for (size_t done = 0; done < size; done += sizeof(erased))
+        {
+            size_t allowed = spend(sizeof(erased));
+            pwrite(fd, erased, allowed, offset + done);
+            if (allowed < sizeof(erased))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int writes = 0;
+    int erases = 0;
+    int overwrites = 0;
+
+private:
+    // How many of the next n bytes get written before the power goes
+    size_t spend(size_t n)
+    {
+        if (powerLeft < 0)
+        {
+            return n;
+        }
+        n = powerLeft < (long)n ? powerLeft : n;
+        powerLeft -= n;
+        return n;
+    }
+
+    char path[32];
+    int fd;
+    int sectors;
+    long powerLeft = -1;
+};
+
+DoseRecord makeRecord(uint32_t scheduled, DoseOutcome outcome, uint16_t latency = 30)
+{
+    DoseRecord record = {};
+    record.scheduled = scheduled;
+    record.ringStart = scheduled;
+    record.latency = latency;
+    record.outcome = outcome;
+    return record;
+}
+
+// Every record from cursor on, checking they are valid and in order
+int collectAll(DoseLog &log, uint32_t cursor, uint32_t *first, uint32_t *last)
+{
+    DoseRecord records[DOSE_SYNC_BATCH];
+    int total = 0;
+    int n;
+    do
+    {
+        n = log.collect(cursor, records, DOSE_SYNC_BATCH);
+        for (int i = 0; i < n; i++)
+        {
+            CHECK(doseValid(records[i]));
+            CHECK(records[i].seq >= cursor);
+            if (total == 0 && first != nullptr)
+            {
+                *first = records[i].seq;
+            }
+            if (last != nullptr)
+            {
+                *last = records[i].seq;
+            }
+            cursor = records[i].seq + 1;
+            total++;
+        }
+    } while (n == DOSE_SYNC_BATCH);
+    return total;
+}
+
+void test_reopen()
+{
+    HostDoseStorage storage(4);
+    DoseLog log;
+    CHECK(log.begin(&storage));
+    CHECK_EQ(log.next(), 0);
+    CHECK_EQ(collectAll(log, 0, nullptr, nullptr), 0);
+
+    for (int i = 0; i < 10; i++)
+    {
+        DoseRecord record = makeRecord(1000 + i, DOSE_TAKEN);
+        CHECK(log.append(record));
+        CHECK_EQ(record.seq, i);
+    }
+
+    DoseLog reopened;
+    CHECK(reopened.begin(&storage));
+    CHECK_EQ(reopened.next(), 10);
+    uint32_t first = 0, last = 0;
+    CHECK_EQ(collectAll(reopened, 0, &first, &last), 10);
+    CHECK_EQ(first, 0);
+    CHECK_EQ(last, 9);
+    CHECK_EQ(collectAll(reopened, 7, &first, &last), 3);
+    CHECK_EQ(first, 7);
+    CHECK_EQ(storage.overwrites, 0);
+}
+
+void test_wraparound()
+{
+    HostDoseStorage storage(4);
+    DoseLog log;
+    log.begin(&storage);
+    const int total = 5 * DOSE_RECORDS_PER_SECTOR + 17;
+    for (int i = 0; i < total; i++)
+    {
+        DoseRecord record = makeRecord(i, DOSE_TAKEN);
+        CHECK(log.append(record));
+    }
+
+    // Three full sectors and the head sector are kept, the oldest records are dropped
+    uint32_t first = 0, last = 0;
+    CHECK_EQ(collectAll(log, 0, &first, &last), 3 * DOSE_RECORDS_PER_SECTOR + 17);
+    CHECK_EQ(first, total - 3 * DOSE_RECORDS_PER_SECTOR - 17);
+    CHECK_EQ(last, total - 1);
+
+    DoseLog reopened;
+    reopened.begin(&storage);
+    CHECK_EQ(reopened.next(), total);
+    CHECK_EQ(storage.overwrites, 0);
+}
+
+// Power lost halfway through a record: it fails its CRC, and its slot is not written again
+void test_torn_write()
+{
+    HostDoseStorage storage(4);
+    DoseLog log;
+    log.begin(&storage);
+    for (int i = 0; i < 5; i++)
+    {
+        DoseRecord record = makeRecord(i, DOSE_TAKEN);
+        log.append(record);
+    }
+    // Cut after the sequence number and the scheduled time
+    storage.cutPowerAfter(8);
+    DoseRecord torn = makeRecord(5, DOSE_MISSED);
+    CHECK(!log.append(torn));
+    storage.restore();
+
+    DoseLog reopened;
+    reopened.begin(&storage);
+    CHECK_EQ(reopened.next(), 5);
+    DoseRecord record = makeRecord(6, DOSE_TAKEN);
+    CHECK(reopened.append(record));
+    CHECK_EQ(record.seq, 5);
+
+    uint32_t first = 0, last = 0;
+    CHECK_EQ(collectAll(reopened, 0, &first, &last), 6);
+    CHECK_EQ(last, 5);
+    DoseRecord latest;
+    CHECK_EQ(reopened.collect(5, &latest, 1), 1);
+    CHECK_EQ(latest.scheduled, 6);
+    CHECK_EQ(storage.overwrites, 0);
+}
+
+// Power lost while erasing the oldest sector to move on to it
+void test_torn_erase()
+{
+    HostDoseStorage storage(4);
+    DoseLog log;
+    log.begin(&storage);
+    const int total = 4 * DOSE_RECORDS_PER_SECTOR;
+    for (int i = 0; i < total; i++)
+    {
+        DoseRecord record = makeRecord(i, DOSE_TAKEN);
+        log.append(record);
+    }
+
+    storage.cutPowerAfter(DOSE_SECTOR_SIZE / 2);
+    DoseRecord lost = makeRecord(total, DOSE_TAKEN);
+    CHECK(!log.append(lost));
+    storage.restore();
+
+    DoseLog reopened;
+    reopened.begin(&storage);
+    CHECK_EQ(reopened.next(), total);
+    DoseRecord record = makeRecord(total, DOSE_TAKEN);
+    CHECK(reopened.append(record));
+    CHECK_EQ(record.seq, total);
+
+    // The half erased sector is erased again before use, and what is left is in order
+    uint32_t first = 0, last = 0;
+    CHECK_EQ(collectAll(reopened, 0, &first, &last), 3 * DOSE_RECORDS_PER_SECTOR + 1);
+    CHECK_EQ(first, DOSE_RECORDS_PER_SECTOR);
+    CHECK_EQ(last, total);
+    CHECK_EQ(storage.overwrites, 0);
+}
+
+// Cut the power anywhere in an append, the log always comes back consistent
+void test_power_cut_anywhere()
+{
+    // Through the erase of the first sector, then at every byte of the record
+    for (long cut = 0; cut <= DOSE_SECTOR_SIZE + (long)sizeof(DoseRecord); cut += cut < DOSE_SECTOR_SIZE ? 64 : 1)
+    {
+        HostDoseStorage storage(2);
+        DoseLog log;
+        log.begin(&storage);
+        // The first append erases a sector, later ones only write
+        storage.cutPowerAfter(cut);
+        DoseRecord record = makeRecord(1, DOSE_TAKEN);
+        bool stored = log.append(record);
+        storage.restore();
+
+        DoseLog reopened;
+        reopened.begin(&storage);
+        CHECK_EQ(reopened.next(), stored ? 1 : 0);
+        DoseRecord next = makeRecord(2, DOSE_TAKEN);
+        CHECK(reopened.append(next));
+        CHECK_EQ(collectAll(reopened, 0, nullptr, nullptr), stored ? 2 : 1);
+        CHECK_EQ(storage.overwrites, 0);
+    }
+}
+
+void test_throughput()
+{
+    HostDoseStorage storage(DOSE_MAX_SECTORS);
+    DoseLog log;
+    log.begin(&storage);
+    storage.erases = storage.writes = 0; // Not counting the format
+
+    const int total = 20 * DOSE_MAX_SECTORS * DOSE_RECORDS_PER_SECTOR;
+    struct timeval start, end;
+    gettimeofday(&start, nullptr);
+    for (int i = 0; i < total; i++)
+    {
+        DoseRecord record = makeRecord(i, DOSE_TAKEN);
+        if (!log.append(record))
+        {
+            CHECK(false);
+            break;
+        }
+    }
+    gettimeofday(&end, nullptr);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%d appends in %.3f s (%.0f/s), %d sector erases\n", total, seconds, total / seconds, storage.erases);
+
+    // Every sector was erased the same number of times
+    CHECK_EQ(storage.erases, total / DOSE_RECORDS_PER_SECTOR);
+    CHECK_EQ(storage.erases % DOSE_MAX_SECTORS, 0);
+    CHECK_EQ(storage.writes, total);
+    CHECK_EQ(storage.overwrites, 0);
+
+    // The whole log is found again after a reboot
+    DoseLog reopened;
+    reopened.begin(&storage);
+    CHECK_EQ(reopened.next(), total);
+    CHECK_EQ(collectAll(reopened, 0, nullptr, nullptr), DOSE_MAX_SECTORS * DOSE_RECORDS_PER_SECTOR);
+}
+
+// Leftovers of whatever the storage held before, some of them passing for records, are erased before use
+void test_foreign_data()
+{
+    HostDoseStorage storage(4);
+    uint8_t noise[DOSE_SECTOR_SIZE];
+    srand(1);
+    for (int sector = 0; sector < 5; sector++)
+    {
+        for (size_t i = 0; i < sizeof(noise); i++)
+        {
+            noise[i] = rand() & 0xFF;
+        }
+        // Every other slot a record with a valid CRC, as an 8-bit CRC lets one in 256 slots of noise be
+        for (size_t i = 0; i < sizeof(noise); i += 2 * sizeof(DoseRecord))
+        {
+            DoseRecord record = makeRecord(rand(), DOSE_MISSED);
+            record.seq = 100000 + rand() % 1000;
+            record.crc = doseCrc(record);
+            memcpy(noise + i, &record, sizeof(record));
+        }
+        storage.write(sector * DOSE_SECTOR_SIZE, noise, sizeof(noise));
+    }
+    storage.overwrites = 0;
+
+    // Power lost while erasing it: it is still not a log, and erased again
+    storage.cutPowerAfter(2 * DOSE_SECTOR_SIZE);
+    DoseLog log;
+    CHECK(!log.begin(&storage));
+    CHECK(!log.available());
+    storage.restore();
+
+    DoseLog reopened;
+    CHECK(reopened.begin(&storage));
+    CHECK_EQ(reopened.next(), 0);
+    CHECK_EQ(collectAll(reopened, 0, nullptr, nullptr), 0);
+    DoseRecord record = makeRecord(1000, DOSE_TAKEN);
+    CHECK(reopened.append(record));
+    CHECK_EQ(record.seq, 0);
+
+    // Once marked, the log is kept
+    int erases = storage.erases;
+    DoseLog again;
+    CHECK(again.begin(&storage));
+    CHECK_EQ(again.next(), 1);
+    CHECK_EQ(collectAll(again, 0, nullptr, nullptr), 1);
+    CHECK_EQ(storage.erases, erases);
+    CHECK_EQ(storage.overwrites, 0);
+}
+
+void test_adherence()
+{
+    HostDoseStorage storage(2);
+    DoseLog log;
+    log.begin(&storage);
+    const uint32_t day = 1718000000;
+    DoseRecord records[] = {
+        makeRecord(day + 100, DOSE_TAKEN, 20),  makeRecord(day + 200, DOSE_SNOOZED),
+        makeRecord(day + 200, DOSE_TAKEN, 40),  makeRecord(day + 300, DOSE_MISSED),
+        makeRecord(day + 86400, DOSE_TAKEN, 5), // The next day
+    };
+    for (DoseRecord &record : records)
+    {
+        log.append(record);
+    }
+
+    DoseSummary summary = doseSummary(log, day, day + 86400);
+    CHECK_EQ(summary.taken, 2);
+    CHECK_EQ(summary.missed, 1);
+    CHECK_EQ(summary.snoozed, 1);
+
+    char json[128];
+    formatAdherence(json, sizeof(json), "2024-06-10", summary);
+    CHECK(strcmp(json, "{\"day\":\"2024-06-10\",\"taken\":2,\"missed\":1,\"snoozed\":1,\"adherence\":66,"
+                       "\"latency\":30}") == 0);
+
+    // A day without doses has no adherence rather than a perfect one
+    summary = doseSummary(log, day - 86400, day);
+    formatAdherence(json, sizeof(json), "2024-06-09", summary);
+    CHECK(strcmp(json, "{\"day\":\"2024-06-09\",\"taken\":0,\"missed\":0,\"snoozed\":0,\"adherence\":null,"
+                       "\"latency\":0}") == 0);
+}
+
+int main()
+{
+    test_reopen();
+    test_wraparound();
+    test_torn_write();
+    test_torn_erase();
+    test_power_cut_anywhere();
+    test_throughput();
+    test_foreign_data();
+    test_adherence();
+    return check_result("test_dose_log");
+}
@@ -0,0 +1,231 @@
+// Trace recording through the input layer on a fake board, read back with the replay's decoder
+#include "check.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#define HIGH 1
+#define LOW 0
+
+struct TempAndHumidity
+{
+    float temperature;
+    float humidity;
+};
+
+#include "inputs.h"
+
+// The board: pins, sensors and clocks set by the tests
+unsigned long now = 0;
+int pins[TRACE_MAX_PINS];
+TempAndHumidity dht = {25.0f, 60.0f};
+int64_t clockMs[2] = {1717986570000LL, 1717986570000LL};
+int commands = 0;
+
+unsigned long millis()
+{
+    return now;
+}
+
+int digitalRead(uint8_t pin)
+{
+    return pins[pin];
+}
+
+uint16_t analogRead(uint8_t pin)
+{
+    return pins[pin];
+}
+
+TempAndHumidity readTempAndHumidity()
+{
+    return dht;
+}
+
+int64_t readClockMs(int clock)
+{
+    return clockMs[clock] + now;
+}
+
+void handleCommand(const char *command, const char *payload)
+{
+    commands++;
+}
+
+// A file in memory, reading from the start
+class MemoryTrace : public TraceFile
+{
+public:
+    std::vector<uint8_t> bytes;
+    size_t position = 0;
+    int flushes = 0;
+
+    size_t read(uint8_t *buf, size_t size)
+    {
+        size = size < bytes.size() - position ? size : bytes.size() - position;
+        memcpy(buf, bytes.data() + position, size);
+        position += size;
+        return size;
+    }
+
+    size_t write(const uint8_t *buf, size_t size)
+    {
+        bytes.insert(bytes.end(), buf, buf + size);
+        return size;
+    }
+
+    void flush()
+    {
+        flushes++;
+    }
+};
+
+// Decode a whole trace, false if it does not end on a record boundary
+bool decode(MemoryTrace &file, std::vector<TraceRecord> &records)
+{
+    file.position = 0;
+    if (!traceReadMagic(&file))
+    {
+        return false;
+    }
+    TraceRecord r = {};
+    while (traceRead(&file, r))
+    {
+        records.push_back(r);
+    }
+    return file.position == file.bytes.size();
+}
+
+void start(MemoryTrace &file)
+{
+    now = 1000;
+    for (int &pin : pins)
+    {
+        pin = HIGH;
+    }
+    resetInputs();
+    traceBegin(&file, now);
+}
+
+// Every kind of input comes back as it was read, with its time
+void test_round_trip()
+{
+    MemoryTrace file;
+    start(file);
+    inputDigitalRead(33);
+    inputClockMs(CLOCK_LOCAL);
+    now += 5;
+    pins[33] = LOW;
+    inputDigitalRead(33);
+    now += 300;
+    pins[5] = 4095;
+    inputAnalogRead(5);
+    dht.humidity = NAN;
+    inputTempAndHumidity();
+    now += 70000;
+    clockMs[CLOCK_LOCAL] += 3000; // Corrected by NTP
+    inputClockMs(CLOCK_LOCAL);
+    inputMessage("adherence", "1");
+    traceEnd(now);
+
+    std::vector<TraceRecord> records;
+    CHECK(decode(file, records));
+    CHECK_EQ(records.size(), 7);
+    CHECK_EQ(records[0].kind, TRACE_DIGITAL);
+    CHECK_EQ(records[0].value[0], HIGH);
+    CHECK_EQ(records[1].kind, TRACE_CLOCK);
+    CHECK_EQ(records[1].value[0], 1717986570000LL + 1000);
+    CHECK_EQ(records[2].at, 5);
+    CHECK_EQ(records[2].value[0], LOW);
+    CHECK_EQ(records[3].kind, TRACE_ANALOG);
+    CHECK_EQ(records[3].channel, 5);
+    CHECK_EQ(records[3].value[0], 4095);
+    CHECK_EQ(records[4].value[0], 250);
+    CHECK_EQ(records[4].value[1], DHT_NAN);
+    CHECK_EQ(records[5].at, 70305);
+    CHECK_EQ(records[5].value[0], 1717986570000LL + 1000 + 3000);
+    CHECK_EQ(records[6].kind, TRACE_MESSAGE);
+    CHECK(strcmp(records[6].command, "adherence") == 0);
+    CHECK(strcmp(records[6].payload, "1") == 0);
+    CHECK_EQ(commands, 1);
+}
+
+// Sensor readings reach the file within TRACE_FLUSH_MS without another record to push them out,
+// and buttons and commands right away
+void test_flush()
+{
+    MemoryTrace file;
+    start(file);
+    pins[5] = 100;
+    inputAnalogRead(5);
+    CHECK(traceStep(now + TRACE_FLUSH_MS - 1));
+    CHECK_EQ(file.bytes.size(), 4);
+    CHECK(traceStep(now + TRACE_FLUSH_MS));
+    CHECK(file.bytes.size() > 4);
+
+    // Nothing buffered, nothing flushed
+    int flushes = file.flushes;
+    traceStep(now + 3 * TRACE_FLUSH_MS);
+    CHECK_EQ(file.flushes, flushes);
+
+    size_t size = file.bytes.size();
+    now += 10;
+    pins[33] = LOW;
+    inputDigitalRead(33);
+    CHECK(file.bytes.size() > size);
+    size = file.bytes.size();
+    inputMessage("on-off", "0");
+    CHECK(file.bytes.size() > size);
+    traceEnd(now);
+}
+
+// A trace that never stops is cut at TRACE_MAX_SIZE on a record boundary, and inputs are still read
+void test_size_cap()
+{
+    MemoryTrace file;
+    start(file);
+    int i = 0;
+    int misread = 0;
+    for (; i < 1000000 && traceStep(now); i++)
+    {
+        now += 7;
+        pins[5] = i % 4096;
+        misread += inputAnalogRead(5) != i % 4096;
+        if (i % 100 == 0)
+        {
+            inputMessage("adherence", "0");
+        }
+    }
+    CHECK(i < 1000000);
+    CHECK(traceFull);
+    CHECK(!tracing);
+    CHECK(file.bytes.size() <= TRACE_MAX_SIZE);
+    CHECK(file.bytes.size() > TRACE_MAX_SIZE - 2 * TRACE_MAX_RECORD);
+    printf("trace full after %d s of readings changing every 7 ms: %zu bytes\n", i * 7 / 1000, file.bytes.size());
+
+    std::vector<TraceRecord> records;
+    CHECK(decode(file, records));
+    CHECK(records.size() > 10000);
+
+    // Inputs are still read once it is full
+    pins[5] = 1;
+    CHECK_EQ(inputAnalogRead(5), 1);
+    CHECK_EQ(misread, 0);
+
+    // Recording again starts a new trace
+    MemoryTrace next;
+    start(next);
+    CHECK(traceStep(now));
+    CHECK(!traceFull);
+    traceEnd(now);
+}
+
+int main()
+{
+    test_round_trip();
+    test_flush();
+    test_size_cap();
+    return check_result("test_inputs");
+}
@@ -0,0 +1,355 @@
+// Scripted button presses through read_button() and update_menu(), with the board stubbed out
+#include "check.h"
+
+#include <string.h>
+
+#define LOW 0
+#define HIGH 1
+#define PB_CANCEL 34
+#define PB_OK 32
+#define PB_UP 33
+#define PB_DOWN 35
+
+constexpr int n_alarms = 3;
+
+#include "menu.h"
+
+// Board stand-ins
+unsigned long now = 0;
+int pin_level[40];
+
+unsigned long inputMillis()
+{
+    return now;
+}
+
+int inputDigitalRead(int pin)
+{
+    return pin_level[pin];
+}
+
+int draws = 0;
+const char *last_message = nullptr;
+
+void clear_display()
+{
+    draws++;
+}
+
+void draw_menu_item()
+{
+    draws++;
+}
+
+void draw_field()
+{
+    draws++;
+}
+
+void draw_field_value()
+{
+    draws++;
+}
+
+void draw_menu_message(const char *message)
+{
+    last_message = message;
+}
+
+// Item callbacks, recording what the menu committed
+int timezone[2] = {0, 0};
+int alarms[n_alarms][2] = {{12, 27}, {12, 27}, {12, 27}};
+int commits = 0;
+int last_commit_index = -1;
+bool alarms_disabled = false;
+
+void load_timezone(int index, int *values)
+{
+    values[0] = timezone[0];
+    values[1] = timezone[1];
+}
+
+void commit_timezone(int index, const int *values)
+{
+    timezone[0] = values[0];
+    timezone[1] = values[1];
+    commits++;
+}
+
+void load_alarm(int index, int *values)
+{
+    values[0] = alarms[index][0];
+    values[1] = alarms[index][1];
+}
+
+void commit_alarm(int index, const int *values)
+{
+    alarms[index][0] = values[0];
+    alarms[index][1] = values[1];
+    last_commit_index = index;
+    commits++;
+}
+
+void commit_disable_alarms(int index, const int *values)
+{
+    alarms_disabled = true;
+    commits++;
+}
+
+// One loop() pass as the sketch runs it
+void step()
+{
+    menu_step(read_button());
+}
+
+// Press and release a button, each edge held past the debounce time
+void press(int pin)
+{
+    pin_level[pin] = LOW;
+    now += DEBOUNCE_MS * 2;
+    step();
+    pin_level[pin] = HIGH;
+    now += DEBOUNCE_MS * 2;
+    step();
+}
+
+void press(int pin, int times)
+{
+    for (int i = 0; i < times; i++)
+    {
+        press(pin);
+    }
+}
+
+void reset()
+{
+    for (int i = 0; i < 40; i++)
+    {
+        pin_level[i] = HIGH;
+    }
+    now += 1000;
+    step();
+    menu_state = MENU_IDLE;
+    current_mode = 0;
+    commits = 0;
+    last_commit_index = -1;
+    alarms_disabled = false;
+    last_message = nullptr;
+}
+
+// Open the mode from the clock screen, leaving the first field in edit
+void open_mode(int mode)
+{
+    press(PB_OK);
+    press(PB_DOWN, (current_mode - mode + max_modes) % max_modes);
+    CHECK_EQ(current_mode, mode);
+    press(PB_OK);
+}
+
+// Step one field past both ends of its range, starting from its maximum
+void check_wrap(int mode, int field, int min, int max)
+{
+    reset();
+    if (mode == 0)
+    {
+        timezone[field] = max;
+    }
+    else
+    {
+        alarms[mode - 1][field] = max;
+    }
+    open_mode(mode);
+    if (field == 1)
+    {
+        press(PB_OK);
+    }
+    CHECK_EQ(menu_state, MENU_EDIT);
+    CHECK_EQ(menu_field, field);
+    CHECK_EQ(menu_values[field], max);
+    press(PB_UP);
+    CHECK_EQ(menu_values[field], min);
+    press(PB_DOWN);
+    CHECK_EQ(menu_values[field], max);
+    press(PB_DOWN);
+    CHECK(menu_values[field] < max);
+    press(PB_UP);
+    CHECK_EQ(menu_values[field], max);
+}
+
+void test_field_wraparound()
+{
+    check_wrap(0, 0, -12, 14);
+    check_wrap(0, 1, 0, 45);
+    for (int alarm = 0; alarm < n_alarms; alarm++)
+    {
+        check_wrap(alarm + 1, 0, 0, 23);
+        check_wrap(alarm + 1, 1, 0, 59);
+    }
+
+    // And from the bottom of the range
+    reset();
+    timezone[0] = -12;
+    open_mode(0);
+    press(PB_DOWN);
+    CHECK_EQ(menu_values[0], 14);
+    reset();
+    timezone[1] = 0;
+    open_mode(0);
+    press(PB_OK);
+    press(PB_DOWN);
+    CHECK_EQ(menu_values[1], 45);
+    reset();
+    alarms[0][0] = 0;
+    open_mode(1);
+    press(PB_DOWN);
+    CHECK_EQ(menu_values[0], 23);
+    reset();
+    alarms[0][1] = 0;
+    open_mode(1);
+    press(PB_OK);
+    press(PB_DOWN);
+    CHECK_EQ(menu_values[1], 59);
+}
+
+void test_browse_wraparound()
+{
+    reset();
+    CHECK_EQ(max_modes, 2 + n_alarms);
+    press(PB_OK);
+    CHECK_EQ(menu_state, MENU_BROWSE);
+    press(PB_DOWN);
+    CHECK_EQ(current_mode, max_modes - 1);
+    CHECK_EQ(menu_item, 2);
+    press(PB_UP);
+    CHECK_EQ(current_mode, 0);
+    for (int mode = 1; mode <= n_alarms; mode++)
+    {
+        press(PB_UP);
+        CHECK_EQ(menu_item, 1);
+        CHECK_EQ(menu_instance, mode - 1);
+    }
+}
+
+void test_cancel()
+{
+    // From browsing back to the clock
+    reset();
+    press(PB_OK);
+    press(PB_CANCEL);
+    CHECK_EQ(menu_state, MENU_IDLE);
+
+    // From either field back to browsing, without committing
+    for (int field = 0; field < 2; field++)
+    {
+        reset();
+        timezone[0] = 5;
+        timezone[1] = 30;
+        open_mode(0);
+        press(PB_OK, field);
+        press(PB_UP);
+        press(PB_CANCEL);
+        CHECK_EQ(menu_state, MENU_BROWSE);
+        CHECK_EQ(commits, 0);
+        CHECK_EQ(timezone[0], 5);
+        CHECK_EQ(timezone[1], 30);
+    }
+
+    // Cancel is ignored while the message is shown
+    reset();
+    open_mode(max_modes - 1);
+    CHECK_EQ(menu_state, MENU_MESSAGE);
+    press(PB_CANCEL);
+    CHECK(menu_state != MENU_IDLE);
+}
+
+void test_commit()
+{
+    // Timezone, both fields edited
+    reset();
+    timezone[0] = 0;
+    timezone[1] = 0;
+    open_mode(0);
+    press(PB_DOWN, 3);
+    press(PB_OK);
+    CHECK_EQ(menu_state, MENU_EDIT);
+    CHECK_EQ(commits, 0);
+    press(PB_UP, 2);
+    press(PB_OK);
+    CHECK_EQ(menu_state, MENU_MESSAGE);
+    CHECK_EQ(commits, 1);
+    CHECK_EQ(timezone[0], -3);
+    CHECK_EQ(timezone[1], 30);
+    CHECK(strcmp(last_message, "Timezone  is Set") == 0);
+
+    // The message times out back to browsing, on the same item
+    now = menu_message_until - 1;
+    step();
+    CHECK_EQ(menu_state, MENU_MESSAGE);
+    now = menu_message_until;
+    step();
+    CHECK_EQ(menu_state, MENU_BROWSE);
+    CHECK_EQ(current_mode, 0);
+
+    // Each alarm instance commits to its own index
+    for (int alarm = 0; alarm < n_alarms; alarm++)
+    {
+        reset();
+        alarms[alarm][0] = 6;
+        alarms[alarm][1] = 0;
+        open_mode(alarm + 1);
+        press(PB_UP);
+        press(PB_OK);
+        press(PB_UP, 15);
+        press(PB_OK);
+        CHECK_EQ(last_commit_index, alarm);
+        CHECK_EQ(alarms[alarm][0], 7);
+        CHECK_EQ(alarms[alarm][1], 15);
+    }
+
+    // An item without fields commits as soon as it is opened
+    reset();
+    open_mode(max_modes - 1);
+    CHECK_EQ(commits, 1);
+    CHECK(alarms_disabled);
+    CHECK(strcmp(last_message, "Alarms Disabled") == 0);
+}
+
+void test_debounce()
+{
+    reset();
+    // A press is reported on its leading edge, and only once while held
+    pin_level[PB_OK] = LOW;
+    now += DEBOUNCE_MS * 2;
+    CHECK_EQ(read_button(), PB_OK);
+    now += DEBOUNCE_MS * 10;
+    CHECK_EQ(read_button(), -1);
+
+    // Bounces on release are not reported as new presses
+    pin_level[PB_OK] = HIGH;
+    now += DEBOUNCE_MS * 2;
+    CHECK_EQ(read_button(), -1);
+    pin_level[PB_OK] = LOW;
+    now += DEBOUNCE_MS / 5;
+    CHECK_EQ(read_button(), -1);
+    pin_level[PB_OK] = HIGH;
+    now += DEBOUNCE_MS / 5;
+    CHECK_EQ(read_button(), -1);
+
+    // The next press is reported once the state has settled
+    pin_level[PB_UP] = LOW;
+    now += DEBOUNCE_MS / 5;
+    CHECK_EQ(read_button(), -1);
+    now += DEBOUNCE_MS;
+    CHECK_EQ(read_button(), PB_UP);
+    pin_level[PB_UP] = HIGH;
+}
+
+int main()
+{
+    test_field_wraparound();
+    test_browse_wraparound();
+    test_cancel();
+    test_commit();
+    test_debounce();
+    return check_result("test_menu");
+}
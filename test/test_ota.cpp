@@ -0,0 +1,463 @@
+// OTA updates against an in-memory HTTP server and flash partition, signed with a throwaway OpenSSL key
+#include "check.h"
+
+#include "ota.h"
+
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+typedef std::vector<uint8_t> Bytes;
+
+// Stands in for the HTTP server, the app partitions and mbedTLS
+class HostOtaPort : public OtaPort
+{
+public:
+    // Server
+    Bytes image;
+    bool ranges = true;          // Honours Range requests
+    size_t dropEvery = 0;        // Bytes sent before each connection drops, 0 to never drop
+    size_t burst = 1460;         // Most bytes available at once
+    int refuse = 0;              // Requests answered with an error
+    unsigned long stallAt = 0;   // Stop sending at this many bytes into the image, 0 for no stall
+    std::vector<size_t> offsets; // Requested offsets
+
+    // Partitions
+    size_t capacity = 0x1C0000;
+    Bytes partition;
+    bool writing = false;
+    int begins = 0;
+    int aborts = 0;
+    size_t largestWrite = 0;
+    bool bootsNewImage = false;
+
+    unsigned long now = 0;
+    std::vector<std::string> statuses;
+    EVP_PKEY *key = nullptr;
+
+    int get(const char *url, size_t offset)
+    {
+        offsets.push_back(offset);
+        if (refuse > 0)
+        {
+            refuse--;
+            return -1; // Connection refused
+        }
+        connected = true;
+        sentNow = 0;
+        position = ranges ? offset : 0;
+        return ranges && offset > 0 ? 206 : 200;
+    }
+
+    int available()
+    {
+        if (!connected || (dropEvery > 0 && sentNow >= dropEvery))
+        {
+            return -1;
+        }
+        if (stallAt > 0 && position >= stallAt)
+        {
+            return 0;
+        }
+        // Up to where the connection drops or stalls
+        size_t left = image.size() - position;
+        if (dropEvery > 0 && dropEvery - sentNow < left)
+        {
+            left = dropEvery - sentNow;
+        }
+        if (stallAt > 0 && stallAt - position < left)
+        {
+            left = stallAt - position;
+        }
+        size_t n = (size_t)(rand() % burst) + 1;
+        return (int)(n < left ? n : left);
+    }
+
+    size_t read(uint8_t *buf, size_t size)
+    {
+        memcpy(buf, image.data() + position, size);
+        position += size;
+        sentNow += size;
+        return size;
+    }
+
+    void close()
+    {
+        connected = false;
+    }
+
+    size_t partitionSize()
+    {
+        return capacity;
+    }
+
+    bool begin()
+    {
+        partition.clear();
+        writing = true;
+        begins++;
+        return true;
+    }
+
+    bool write(const uint8_t *buf, size_t size)
+    {
+        CHECK(writing);
+        largestWrite = size > largestWrite ? size : largestWrite;
+        partition.insert(partition.end(), buf, buf + size);
+        return true;
+    }
+
+    void abort()
+    {
+        writing = false;
+        aborts++;
+    }
+
+    bool activate()
+    {
+        bootsNewImage = writing;
+        writing = false;
+        return bootsNewImage;
+    }
+
+    void hashStart()
+    {
+        EVP_MD_CTX_free(sha);
+        sha = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(sha, EVP_sha256(), nullptr);
+    }
+
+    void hashUpdate(const uint8_t *buf, size_t size)
+    {
+        EVP_DigestUpdate(sha, buf, size);
+    }
+
+    // Same check as mbedtls_pk_verify() on the board: ECDSA over the SHA-256 of the image
+    bool verify(const uint8_t *signature, size_t length)
+    {
+        uint8_t digest[32];
+        unsigned int digestLength = 0;
+        EVP_DigestFinal_ex(sha, digest, &digestLength);
+        EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, nullptr);
+        bool valid = EVP_PKEY_verify_init(ctx) == 1 && EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) == 1 &&
+                     EVP_PKEY_verify(ctx, signature, length, digest, digestLength) == 1;
+        EVP_PKEY_CTX_free(ctx);
+        return valid;
+    }
+
+    unsigned long millis()
+    {
+        return now;
+    }
+
+    void status(const char *status)
+    {
+        statuses.push_back(status);
+    }
+
+    bool reported(const char *status) const
+    {
+        for (const std::string &s : statuses)
+        {
+            if (s == status)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    ~HostOtaPort()
+    {
+        EVP_MD_CTX_free(sha);
+    }
+
+private:
+    bool connected = false;
+    size_t position = 0;
+    size_t sentNow = 0;
+    EVP_MD_CTX *sha = nullptr;
+};
+
+EVP_PKEY *signingKey;
+EVP_PKEY *otherKey;
+
+// A P-256 key like the one in ota_key.h, made in a way OpenSSL 1.1 also supports
+EVP_PKEY *generateKey()
+{
+    EVP_PKEY *key = nullptr;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    if (EVP_PKEY_keygen_init(ctx) != 1 || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) != 1 ||
+        EVP_PKEY_keygen(ctx, &key) != 1)
+    {
+        key = nullptr;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+// What the release step does: openssl dgst -sha256 -sign
+Bytes sign(const Bytes &image, EVP_PKEY *key)
+{
+    size_t length = 0;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestSignInit(ctx, nullptr, EVP_sha256(), nullptr, key);
+    EVP_DigestSign(ctx, nullptr, &length, image.data(), image.size());
+    Bytes signature(length);
+    EVP_DigestSign(ctx, signature.data(), &length, image.data(), image.size());
+    signature.resize(length);
+    EVP_MD_CTX_free(ctx);
+    return signature;
+}
+
+Bytes makeImage(size_t size)
+{
+    Bytes image(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        image[i] = (uint8_t)(i * 31 + (i >> 8));
+    }
+    return image;
+}
+
+// Step the update like loop() does, 5 ms apart, until it reboots or gives up
+bool run(OtaUpdate &update, HostOtaPort &port, int *steps = nullptr)
+{
+    int n = 0;
+    while (update.downloading() && n < 1000000)
+    {
+        n++;
+        port.now += 5;
+        if (update.step())
+        {
+            break;
+        }
+    }
+    if (steps != nullptr)
+    {
+        *steps = n;
+    }
+    return port.bootsNewImage;
+}
+
+void setup(HostOtaPort &port, size_t size)
+{
+    port.image = makeImage(size);
+    port.key = signingKey;
+}
+
+void test_chunking()
+{
+    HostOtaPort port;
+    setup(port, 300 * 1024 + 123);
+    OtaUpdate update(port);
+    Bytes signature = sign(port.image, signingKey);
+
+    CHECK(update.begin("http://host/firmware.bin", port.image.size(), signature.data(), signature.size()));
+    int steps = 0;
+    CHECK(run(update, port, &steps));
+    CHECK(port.partition == port.image);
+    CHECK(port.largestWrite <= OTA_CHUNK_SIZE);
+    // Never more than a chunk per loop(), so alarms keep running
+    CHECK(steps >= (int)(port.image.size() / OTA_CHUNK_SIZE));
+    CHECK_EQ(port.begins, 1);
+    CHECK(port.reported("downloading 50%"));
+    CHECK(port.reported("downloading 100%"));
+    CHECK_EQ(port.statuses.back() == "rebooting", true);
+}
+
+void test_resume()
+{
+    // The connection drops every 100 KB, and each retry asks for the rest
+    HostOtaPort port;
+    setup(port, 350 * 1024);
+    port.dropEvery = 100 * 1024;
+    OtaUpdate update(port);
+    Bytes signature = sign(port.image, signingKey);
+
+    CHECK(update.begin("http://host/firmware.bin", port.image.size(), signature.data(), signature.size()));
+    CHECK(run(update, port));
+    CHECK(port.partition == port.image);
+    CHECK_EQ(port.begins, 1);
+    CHECK_EQ(port.offsets.size(), 4);
+    for (size_t i = 0; i < port.offsets.size(); i++)
+    {
+        CHECK_EQ(port.offsets[i], i * 100 * 1024);
+    }
+}
+
+void test_restart_without_ranges()
+{
+    // A server that ignores Range sends the whole image again, which is then taken from the start
+    HostOtaPort port;
+    setup(port, 150 * 1024);
+    port.dropEvery = 100 * 1024;
+    port.ranges = false;
+    OtaUpdate update(port);
+    Bytes signature = sign(port.image, signingKey);
+
+    CHECK(update.begin("http://host/firmware.bin", port.image.size(), signature.data(), signature.size()));
+    // Stop dropping once the first retry is under way
+    while (update.downloading() && port.offsets.size() < 2)
+    {
+        port.now += 5;
+        update.step();
+    }
+    port.dropEvery = 0;
+    CHECK(run(update, port));
+    CHECK(port.partition == port.image);
+    CHECK_EQ(port.begins, 2);
+    CHECK_EQ(port.aborts, 1);
+}
+
+void test_stall()
+{
+    // No data for OTA_STALL_MS reconnects, from where it stopped
+    HostOtaPort port;
+    setup(port, 64 * 1024);
+    port.stallAt = 20 * 1024;
+    OtaUpdate update(port);
+    Bytes signature = sign(port.image, signingKey);
+
+    CHECK(update.begin("http://host/firmware.bin", port.image.size(), signature.data(), signature.size()));
+    while (update.received() < port.stallAt)
+    {
+        port.now += 5;
+        update.step();
+    }
+    unsigned long stalled = port.now;
+    while (port.offsets.size() < 2 && port.now - stalled < 2 * OTA_STALL_MS)
+    {
+        port.now += 5;
+        update.step();
+    }
+    CHECK_EQ(port.offsets.size(), 2);
+    CHECK(port.now - stalled > OTA_STALL_MS);
+    CHECK(port.now - stalled <= OTA_STALL_MS + 5);
+    CHECK_EQ(port.offsets[1], port.stallAt);
+    port.stallAt = 0;
+    CHECK(run(update, port));
+    CHECK(port.partition == port.image);
+}
+
+void test_give_up()
+{
+    // Dropping after every byte, the retries run out and the partition is released
+    HostOtaPort port;
+    setup(port, 64 * 1024);
+    port.dropEvery = 1;
+    port.burst = 1;
+    OtaUpdate update(port);
+    Bytes signature = sign(port.image, signingKey);
+
+    CHECK(update.begin("http://host/firmware.bin", port.image.size(), signature.data(), signature.size()));
+    CHECK(!run(update, port));
+    CHECK_EQ(port.offsets.size(), 1 + OTA_MAX_RETRIES);
+    CHECK(port.reported("download failed"));
+    CHECK(!port.writing);
+
+    // Refused outright
+    HostOtaPort refused;
+    setup(refused, 1024);
+    refused.refuse = 1;
+    OtaUpdate update2(refused);
+    CHECK(!update2.begin("http://host/firmware.bin", refused.image.size(), signature.data(), signature.size()));
+    CHECK(refused.reported("download failed"));
+    CHECK(!update2.downloading());
+}
+
+void test_signature()
+{
+    // Signed by someone else
+    HostOtaPort port;
+    setup(port, 40 * 1024);
+    OtaUpdate update(port);
+    Bytes signature = sign(port.image, otherKey);
+    CHECK(update.begin("http://host/firmware.bin", port.image.size(), signature.data(), signature.size()));
+    CHECK(!run(update, port));
+    CHECK(port.reported("bad signature"));
+    CHECK(!port.writing);
+
+    // Tampered with on the way
+    HostOtaPort tampered;
+    setup(tampered, 40 * 1024);
+    signature = sign(tampered.image, signingKey);
+    tampered.image[12345] ^= 1;
+    OtaUpdate update2(tampered);
+    CHECK(update2.begin("http://host/firmware.bin", tampered.image.size(), signature.data(), signature.size()));
+    CHECK(!run(update2, tampered));
+    CHECK(tampered.reported("bad signature"));
+
+    // Cut short: the signature covers every byte of the image
+    HostOtaPort truncated;
+    setup(truncated, 40 * 1024);
+    signature = sign(truncated.image, signingKey);
+    OtaUpdate update3(truncated);
+    CHECK(update3.begin("http://host/firmware.bin", truncated.image.size() - 1, signature.data(), signature.size()));
+    CHECK(!run(update3, truncated));
+    CHECK(truncated.reported("bad signature"));
+}
+
+void test_requests()
+{
+    HostOtaPort port;
+    setup(port, 1024);
+    OtaUpdate update(port);
+    Bytes signature = sign(port.image, signingKey);
+
+    CHECK(!update.begin("http://host/firmware.bin", port.capacity + 1, signature.data(), signature.size()));
+    CHECK(port.reported("image does not fit"));
+    CHECK(!update.begin("http://host/firmware.bin", 1024, signature.data(), 0));
+    CHECK(port.reported("invalid request"));
+    std::string longUrl = "http://host/" + std::string(OTA_MAX_URL, 'x');
+    CHECK(!update.begin(longUrl.c_str(), 1024, signature.data(), signature.size()));
+
+    CHECK(update.begin("http://host/firmware.bin", 1024, signature.data(), signature.size()));
+    CHECK(!update.begin("http://host/firmware.bin", 1024, signature.data(), signature.size()));
+    CHECK(port.reported("busy"));
+    CHECK(run(update, port));
+}
+
+void test_rollback()
+{
+    // A new image that reaches the broker in time is kept
+    CHECK_EQ(otaHealth(false, 1000), OTA_HEALTH_WAIT);
+    CHECK_EQ(otaHealth(true, 1000), OTA_HEALTH_CONFIRM);
+    CHECK_EQ(otaHealth(true, OTA_HEALTH_TIMEOUT_MS + 1), OTA_HEALTH_CONFIRM);
+
+    // One that never does is rolled back right after the timeout
+    unsigned long rolledBackAt = 0;
+    for (unsigned long uptime = 0; uptime < 2 * OTA_HEALTH_TIMEOUT_MS; uptime += 10)
+    {
+        if (otaHealth(false, uptime) == OTA_HEALTH_ROLLBACK)
+        {
+            rolledBackAt = uptime;
+            break;
+        }
+    }
+    CHECK(rolledBackAt > OTA_HEALTH_TIMEOUT_MS);
+    CHECK(rolledBackAt <= OTA_HEALTH_TIMEOUT_MS + 10);
+}
+
+int main()
+{
+    srand(1);
+    signingKey = generateKey();
+    otherKey = generateKey();
+
+    test_chunking();
+    test_resume();
+    test_restart_without_ranges();
+    test_stall();
+    test_give_up();
+    test_signature();
+    test_requests();
+    test_rollback();
+
+    EVP_PKEY_free(signingKey);
+    EVP_PKEY_free(otherKey);
+    return check_result("test_ota");
+}
@@ -0,0 +1,387 @@
+// Sleep windows of loop() on a virtual clock, in normal and low power mode
+#include "check.h"
+
+#include "power.h"
+
+#define WATCHDOG_MS 30000UL
+
+void test_deadlines()
+{
+    CHECK_EQ(clockPeriod(false, 0), UPDATE_PERIOD_MS);
+    CHECK_EQ(clockPeriod(false, 59), UPDATE_PERIOD_MS);
+    CHECK_EQ(clockPeriod(true, 0), 60000);
+    CHECK_EQ(clockPeriod(true, 59), 1000);
+
+    CHECK_EQ(periodLeft(1500, 1000, 1000), 500);
+    CHECK_EQ(periodLeft(2500, 1000, 1000), 0);
+    // Across the millis() wraparound
+    CHECK_EQ(periodLeft(200, (unsigned long)-256, 1000), 1000 - 456);
+
+    // Due for the whole minute, then a day away
+    CHECK_EQ(alarmLeft((7 * 60 + 30) * 60, 7, 30), 0);
+    CHECK_EQ(alarmLeft((7 * 60 + 30) * 60 + 59, 7, 30), 0);
+    CHECK_EQ(alarmLeft((7 * 60 + 31) * 60, 7, 30), (24 * 60 - 1) * 60 * 1000UL);
+    CHECK_EQ(alarmLeft((7 * 60 + 29) * 60 + 15, 7, 30), 45000);
+    // Past midnight
+    CHECK_EQ(alarmLeft((23 * 60 + 59) * 60 + 30, 0, 0), 30000);
+
+    CHECK_EQ(epochLeft(1000, 990), 10000);
+    CHECK_EQ(epochLeft(1000, 1010), 0);
+
+    CHECK_EQ(lightSleepWindow(60000, WATCHDOG_MS), WATCHDOG_MS / 2);
+    CHECK_EQ(lightSleepWindow(1000, WATCHDOG_MS), 1000);
+}
+
+// loop() on a virtual clock, sleeping for the windows sleepWindow() gives
+// Alarm 0 is snoozed the first time it rings and taken the second, the others are taken at once
+#define ANSWER_MS 5000 // Time to answer a ringing alarm
+#define BUZZER_MS 3000 // Time the scheduled buzzer stays on
+#define N_ALARMS 3
+
+struct Simulation
+{
+    bool lowPower;
+    bool wifi;
+    long startOfDay; // Time of day at millis() 0, in milliseconds
+
+    int alarmHours[N_ALARMS];
+    int alarmMinutes[N_ALARMS];
+    bool alarmTriggered[N_ALARMS] = {};
+    unsigned long snoozeUntil[N_ALARMS] = {};
+    bool alarmsEnabled = true;
+    bool scheduled = false;
+    unsigned long scheduledTime = 0;
+
+    unsigned long now = 0;
+    unsigned long timeLast = 0;
+    unsigned long sensorLast = 0;
+    long daySeconds = 0; // Read at the last clock update
+    int ringing = -1;
+    unsigned long ringUntil = 0;
+    bool buzzer = false;
+    unsigned long buzzerUntil = 0;
+
+    int wakeups = 0;
+    int clockUpdates = 0;
+    int sensorReads = 0;
+    int lateClockUpdates = 0;
+    int sleepsWhileBusy = 0;
+    unsigned long longestSleep = 0;
+    long alarmLatency[N_ALARMS] = {-1, -1, -1};
+    long snoozeLatency = -1;
+    long scheduleLatency = -1;
+
+    Simulation(bool lowPower, bool wifi, long startOfDay) : lowPower(lowPower), wifi(wifi), startOfDay(startOfDay)
+    {
+        // Off until a test sets them
+        for (int i = 0; i < N_ALARMS; i++)
+        {
+            alarmHours[i] = 0;
+            alarmMinutes[i] = 0;
+            alarmTriggered[i] = true;
+        }
+    }
+
+    void setAlarm(int i, int hour, int minute)
+    {
+        alarmHours[i] = hour;
+        alarmMinutes[i] = minute;
+        alarmTriggered[i] = false;
+    }
+
+    // Local and NTP clock, in seconds since the start of day 0
+    unsigned long epoch() const
+    {
+        return (startOfDay + now) / 1000;
+    }
+
+    // Milliseconds past a time of day, to check how late something ran
+    long lateBy(long seconds) const
+    {
+        return (long)((startOfDay + now) % (24 * 60 * 60 * 1000L)) - seconds * 1000;
+    }
+
+    PowerInputs inputs() const
+    {
+        PowerInputs in = {};
+        in.now = now;
+        in.lowPower = lowPower;
+        in.clockLast = timeLast;
+        in.clockPeriod = clockPeriod(lowPower, daySeconds % 60);
+        in.sensorLast = sensorLast;
+        in.sensorPeriod = lowPower ? SENSOR_PERIOD_LOW_POWER_MS : SENSOR_PERIOD_MS;
+        in.daySeconds = daySeconds;
+        in.epoch = epoch();
+        in.alarmsEnabled = alarmsEnabled;
+        in.alarms = N_ALARMS;
+        in.alarmHours = alarmHours;
+        in.alarmMinutes = alarmMinutes;
+        in.alarmTriggered = alarmTriggered;
+        in.snoozeUntil = snoozeUntil;
+        in.scheduled = scheduled;
+        in.scheduledTime = scheduledTime;
+        in.ntpEpoch = epoch();
+        in.menuIdle = true;
+        in.buzzer = buzzer;
+        in.ringing = ringing >= 0;
+        return in;
+    }
+
+    // The clock update, ringing the alarms that are due like update_time_with_check_alarm()
+    void updateClock()
+    {
+        bool periodic = clockUpdates > 0 && now - timeLast >= clockPeriod(lowPower, daySeconds % 60);
+        timeLast = now;
+        daySeconds = (long)(epoch() % (24 * 60 * 60));
+        clockUpdates++;
+        // Once running, low power updates land on the minute, other than the early ones for alarms
+        if (lowPower && periodic && daySeconds % 60 != 0)
+        {
+            lateClockUpdates++;
+        }
+
+        for (int i = 0; alarmsEnabled && ringing < 0 && i < N_ALARMS; i++)
+        {
+            if (!alarmTriggered[i] && daySeconds / 60 == alarmHours[i] * 60L + alarmMinutes[i])
+            {
+                alarmTriggered[i] = true;
+                alarmLatency[i] = lateBy((alarmHours[i] * 60L + alarmMinutes[i]) * 60);
+                ringing = i;
+                ringUntil = now + ANSWER_MS;
+            }
+            else if (snoozeUntil[i] != 0 && epoch() >= snoozeUntil[i])
+            {
+                snoozeLatency = (long)(startOfDay + now - snoozeUntil[i] * 1000);
+                snoozeUntil[i] = 0;
+                ringing = i;
+                ringUntil = now + ANSWER_MS;
+            }
+        }
+    }
+
+    void loop()
+    {
+        wakeups++;
+        if (scheduled && epoch() > scheduledTime)
+        {
+            scheduled = false;
+            scheduleLatency = (long)(startOfDay + now - (scheduledTime + 1) * 1000);
+            buzzer = true;
+            buzzerUntil = now + BUZZER_MS;
+        }
+        if (buzzer && now >= buzzerUntil)
+        {
+            buzzer = false;
+        }
+        if (ringing >= 0 && now >= ringUntil)
+        {
+            // The first ring of alarm 0 is snoozed for ten minutes
+            if (ringing == 0 && snoozeLatency < 0)
+            {
+                snoozeUntil[0] = epoch() + 600;
+            }
+            ringing = -1;
+        }
+
+        unsigned long sensorPeriod = lowPower ? SENSOR_PERIOD_LOW_POWER_MS : SENSOR_PERIOD_MS;
+        if (now - sensorLast >= sensorPeriod)
+        {
+            sensorLast = now;
+            sensorReads++;
+        }
+        if (clockDue(inputs()))
+        {
+            updateClock();
+        }
+
+        unsigned long window = sleepWindow(inputs());
+        if (window == 0)
+        {
+            now += 1; // One pass of loop()
+            return;
+        }
+        if (ringing >= 0 || buzzer)
+        {
+            sleepsWhileBusy++;
+        }
+        if (!wifi)
+        {
+            window = lightSleepWindow(window, WATCHDOG_MS);
+        }
+        longestSleep = window > longestSleep ? window : longestSleep;
+        now += window;
+    }
+
+    void run(unsigned long until)
+    {
+        while (now < until)
+        {
+            loop();
+        }
+    }
+};
+
+void test_normal_mode()
+{
+    Simulation sim(false, true, 8 * 3600000L + 123);
+    sim.setAlarm(0, 9, 0);
+    sim.run(3600000UL + 2000);
+    CHECK(sim.wakeups >= 3600000);
+    CHECK(sim.clockUpdates >= 3590);
+    CHECK(sim.alarmLatency[0] >= 0 && sim.alarmLatency[0] <= 1000);
+}
+
+void check_low_power(bool wifi)
+{
+    // Start mid-second and mid-minute, with the alarm an hour later
+    Simulation sim(true, wifi, (8 * 3600L + 17) * 1000 + 456);
+    sim.setAlarm(0, 9, 0);
+    sim.run(2 * 3600000UL);
+    printf("low power, WiFi %s: %d wakeups an hour, longest sleep %lu ms, alarm after %ld ms\n",
+           wifi ? "up" : "down", sim.wakeups / 2, sim.longestSleep, sim.alarmLatency[0]);
+
+    // A refresh every minute and a reading every 30 s, instead of thousands of wakeups
+    // With WiFi down the watchdog also wakes the board every 15 s
+    // The alarm and its snooze each keep loop() running while they ring
+    CHECK(sim.wakeups / 2 <= (wifi ? 180 : 300) + ANSWER_MS);
+    CHECK(sim.clockUpdates >= 119 && sim.clockUpdates <= 124);
+    CHECK(sim.sensorReads >= 239 && sim.sensorReads <= 241);
+    CHECK_EQ(sim.lateClockUpdates, 0);
+    CHECK(sim.longestSleep > UPDATE_PERIOD_MS);
+    CHECK(sim.longestSleep <= (wifi ? SENSOR_PERIOD_LOW_POWER_MS : WATCHDOG_MS / 2));
+    CHECK_EQ(sim.sleepsWhileBusy, 0);
+
+    // The alarm still rings within a second of its minute, and again ten minutes after it was snoozed
+    CHECK(sim.alarmLatency[0] >= 0 && sim.alarmLatency[0] < 1000);
+    CHECK(sim.snoozeLatency >= 0 && sim.snoozeLatency < 1000);
+}
+
+void test_low_power()
+{
+    check_low_power(true);
+    check_low_power(false);
+}
+
+// Two alarms in the same minute ring one after the other, and the buzzer schedule fires on time
+void test_alarms_and_schedule()
+{
+    Simulation sim(true, false, (6 * 3600L + 40 * 60) * 1000 + 789);
+    sim.setAlarm(1, 7, 0);
+    sim.setAlarm(2, 7, 0);
+    sim.scheduled = true;
+    sim.scheduledTime = sim.epoch() + 1234;
+    sim.run(3600000UL);
+    printf("alarms after %ld and %ld ms, buzzer schedule after %ld ms\n", sim.alarmLatency[1], sim.alarmLatency[2],
+           sim.scheduleLatency);
+    CHECK(sim.alarmLatency[1] >= 0 && sim.alarmLatency[1] < 1000);
+    // The second waits for the first to be answered
+    CHECK(sim.alarmLatency[2] >= ANSWER_MS && sim.alarmLatency[2] < ANSWER_MS + 1000);
+    CHECK(sim.scheduleLatency >= 0 && sim.scheduleLatency < 1000);
+    CHECK_EQ(sim.sleepsWhileBusy, 0);
+    CHECK(!sim.scheduled && !sim.buzzer);
+
+    // Disabled alarms do not shorten the sleep, the schedule still does
+    Simulation off(true, false, (6 * 3600L + 59 * 60) * 1000);
+    off.setAlarm(0, 7, 0);
+    off.alarmsEnabled = false;
+    off.scheduled = true;
+    off.scheduledTime = off.epoch() + 10;
+    off.run(120000);
+    CHECK_EQ(off.alarmLatency[0], -1);
+    CHECK(off.scheduleLatency >= 0 && off.scheduleLatency < 1000);
+}
+
+// Nothing sleeps outside low power mode, in the menu, or while ringing, buzzing or downloading
+void test_sleep_allowed()
+{
+    Simulation sim(true, true, 8 * 3600000L);
+    sim.setAlarm(0, 12, 0);
+    PowerInputs in = sim.inputs();
+    CHECK(sleepWindow(in) > 0);
+    CHECK_EQ(sleepWindow(in), nextDeadline(in));
+
+    PowerInputs busy = in;
+    busy.lowPower = false;
+    CHECK_EQ(sleepWindow(busy), 0);
+    busy = in;
+    busy.menuIdle = false;
+    CHECK_EQ(sleepWindow(busy), 0);
+    busy = in;
+    busy.buzzer = true;
+    CHECK_EQ(sleepWindow(busy), 0);
+    busy = in;
+    busy.ringing = true;
+    CHECK_EQ(sleepWindow(busy), 0);
+    busy = in;
+    busy.downloading = true;
+    CHECK_EQ(sleepWindow(busy), 0);
+
+    // Too short to be worth it
+    in.clockLast = in.now - in.clockPeriod + MIN_SLEEP_MS - 1;
+    CHECK_EQ(sleepWindow(in), 0);
+}
+
+// A replay jumps from deadline to deadline: a ringing alarm, a menu message and a bouncing button have theirs
+void test_ui_deadlines()
+{
+    Simulation sim(true, true, 8 * 3600000L);
+    PowerInputs in = sim.inputs();
+    CHECK(nextDeadline(in) > 1000);
+
+    PowerInputs busy = in;
+    busy.ringing = true;
+    busy.ringLeft = 300;
+    CHECK_EQ(nextDeadline(busy), 300);
+    busy.ringLeft = 0;
+    CHECK_EQ(nextDeadline(busy), 0);
+
+    busy = in;
+    busy.menuIdle = false;
+    busy.menuMessage = true;
+    busy.menuMessageUntil = in.now + 400;
+    CHECK_EQ(nextDeadline(busy), 400);
+    busy.menuMessageUntil = in.now - 1;
+    CHECK_EQ(nextDeadline(busy), 0);
+
+    busy = in;
+    busy.buttonSettleLeft = 30;
+    CHECK_EQ(nextDeadline(busy), 30);
+}
+
+// While WiFi is up the buttons are polled, a press waits at most one poll
+void test_button_latency()
+{
+    unsigned long windows[] = {MIN_SLEEP_MS, 999, 30000};
+    unsigned long worst = 0;
+    for (unsigned long window : windows)
+    {
+        for (unsigned long pressAt = 0; pressAt < window; pressAt += 7)
+        {
+            unsigned long elapsed = 0;
+            while (elapsed < window)
+            {
+                elapsed += pollSlice(window, elapsed);
+                if (elapsed >= pressAt)
+                {
+                    break;
+                }
+            }
+            CHECK(elapsed >= pressAt);
+            worst = elapsed - pressAt > worst ? elapsed - pressAt : worst;
+        }
+    }
+    printf("worst button latency %lu ms\n", worst);
+    CHECK(worst <= BUTTON_POLL_MS);
+}
+
+int main()
+{
+    test_deadlines();
+    test_normal_mode();
+    test_low_power();
+    test_alarms_and_schedule();
+    test_sleep_allowed();
+    test_ui_deadlines();
+    test_button_latency();
+    return check_result("test_power");
+}
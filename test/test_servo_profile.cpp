@@ -0,0 +1,125 @@
+// The precomputed angle tables against the formula AdjustServoMotor() used to evaluate on every reading
+#include "check.h"
+
+#include "servo_profile.h"
+
+#include <stdlib.h>
+
+// The built-in profiles of the sketch
+const ServoProfileParams builtin[] = {
+    {'D', 30, 0.75, 1, {0.5, 1.5}},
+    {'A', 30, 0.5, 1, {0.5, 1.5}},
+    {'B', 45, 0.3, 1, {0.5, 1.5}},
+    {'C', 60, 0.8, 1, {0.5, 1.5}},
+};
+
+// The old AdjustServoMotor(), from the float reading of the brighter LDR to the angle Servo::write() got
+int oldAngle(const ServoProfileParams &p, float reading, int side)
+{
+    const float analogMinValue = 0.0;
+    const float analogMaxValue = 1023.0;
+    double lightintensity = (reading - analogMinValue) / (analogMaxValue - analogMinValue);
+    double angle = p.minAngle * p.offset[side] + (180.0 - p.minAngle) * lightintensity * p.controllingFac;
+    angle = angle < 180.0 ? angle : 180.0;
+    return (int)angle;
+}
+
+void test_quantisation()
+{
+    CHECK_EQ(intensityLevel(0, 1023), 0);
+    CHECK_EQ(intensityLevel(1023, 1023), INTENSITY_LEVELS - 1);
+
+    // Nearest level, and every level is reachable
+    int hits[INTENSITY_LEVELS] = {0};
+    int previous = 0;
+    for (int reading = 0; reading <= 1023; reading++)
+    {
+        int level = intensityLevel(reading, 1023);
+        CHECK_EQ(level, lround(reading * 255.0 / 1023));
+        CHECK(level >= previous);
+        previous = level;
+        hits[level]++;
+    }
+    for (int level = 0; level < INTENSITY_LEVELS; level++)
+    {
+        CHECK(hits[level] >= 3 && hits[level] <= 5);
+    }
+}
+
+void test_truncation()
+{
+    ServoProfile profile = {builtin[0]};
+    buildProfile(profile);
+    // 30 * 0.5 + 150 * 0.75 = 127.5 and 30 * 1.5 = 45
+    CHECK_EQ(profile.angles[LDR_RIGHT][255], 127);
+    CHECK_EQ(profile.angles[LDR_LEFT][0], 45);
+
+    // 60 * 1.5 + 120 * 0.8 = 186, held at the end stop
+    profile.params = builtin[3];
+    buildProfile(profile);
+    CHECK_EQ(profile.angles[LDR_LEFT][255], 180);
+
+    // A negative angle stops at 0 instead of wrapping around the byte
+    profile.params = {'N', 30, -2, 1, {0.5, 0.5}};
+    buildProfile(profile);
+    CHECK_EQ(profile.angles[LDR_RIGHT][0], 15);
+    CHECK_EQ(profile.angles[LDR_RIGHT][255], 0);
+}
+
+void test_against_old_formula()
+{
+    for (const ServoProfileParams &params : builtin)
+    {
+        ServoProfile profile = {params};
+        buildProfile(profile);
+        for (int side = 0; side < 2; side++)
+        {
+            int worst = 0;
+            for (int reading = 0; reading <= 1023; reading++)
+            {
+                int old = oldAngle(params, reading, side);
+                int level = intensityLevel(reading, 1023);
+                int now = profile.angles[side][level];
+
+                // Readings that fall exactly on a level give the same angle
+                if (reading * 255 % 1023 == 0)
+                {
+                    CHECK_EQ(now, old);
+                }
+                // Elsewhere the level is at most half a step off, less than a degree at the steepest
+                int error = abs(now - old);
+                CHECK(error <= 1);
+                worst = error > worst ? error : worst;
+            }
+            printf("profile %c side %d: worst difference %d degree\n", params.id, side, worst);
+        }
+    }
+}
+
+void test_gamma()
+{
+    ServoProfile linear = {builtin[0]};
+    ServoProfile curved = {builtin[0]};
+    curved.params.gamma = 2;
+    buildProfile(linear);
+    buildProfile(curved);
+    for (int side = 0; side < 2; side++)
+    {
+        // Same end points, below the line in between
+        CHECK_EQ(curved.angles[side][0], linear.angles[side][0]);
+        CHECK_EQ(curved.angles[side][255], linear.angles[side][255]);
+        for (int level = 1; level < 255; level++)
+        {
+            CHECK(curved.angles[side][level] <= linear.angles[side][level]);
+        }
+    }
+}
+
+int main()
+{
+    test_quantisation();
+    test_truncation();
+    test_against_old_formula();
+    test_gamma();
+    return check_result("test_servo_profile");
+}
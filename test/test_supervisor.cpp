@@ -0,0 +1,267 @@
+// Supervisor on a virtual clock, with hangs injected into stand-ins for the display, WiFi and MQTT
+#include "check.h"
+
+#include "supervisor.h"
+
+#include <vector>
+
+// A component that fails at a given time and comes back after a given recovery step, if any
+struct Fault
+{
+    bool down = false;
+    int fixedBy = -1;      // Recovery step that brings it back, -1 for none
+    bool internal = false; // The fault is in the device, e.g. the WiFi driver is stuck with the AP in sight
+    bool flickers = false; // Only looks internal at every other check, like a status caught between attempts
+    std::vector<int> steps;
+    std::vector<unsigned long> times;
+};
+
+unsigned long now = 0;
+Fault faults[3];
+
+template <int N>
+bool healthy()
+{
+    return !faults[N].down;
+}
+
+template <int N>
+void recover(int step)
+{
+    faults[N].steps.push_back(step);
+    faults[N].times.push_back(now);
+    if (step == faults[N].fixedBy)
+    {
+        faults[N].down = false;
+    }
+}
+
+template <int N>
+bool internalFault()
+{
+    return faults[N].internal && !(faults[N].flickers && now / SUPERVISOR_PERIOD_MS % 2 == 1);
+}
+
+// The sketch's components
+const Component components[] = {
+    {"display", DISPLAY_TIMEOUT_MS, DISPLAY_STEPS, healthy<0>, recover<0>, nullptr},
+    {"wifi", WIFI_TIMEOUT_MS, WIFI_STEPS, healthy<1>, recover<1>, internalFault<1>},
+    {"mqtt", MQTT_TIMEOUT_MS, MQTT_STEPS, healthy<2>, recover<2>, nullptr},
+};
+#define DISPLAY 0
+#define WIFI 1
+#define MQTT 2
+
+struct Run
+{
+    const Component *reset = nullptr;
+    unsigned long resetAt = 0;
+};
+
+// Run the supervisor once a period from the current time on, until a reset or the end
+// hangMs stalls loop() once at hangAt, as a blocking call shorter than the watchdog timeout would
+Run run(Supervisor &supervisor, unsigned long until, unsigned long hangAt = 0, unsigned long hangMs = 0)
+{
+    Run result;
+    for (; now < until; now += SUPERVISOR_PERIOD_MS)
+    {
+        if (hangMs > 0 && now == hangAt)
+        {
+            now += hangMs;
+        }
+        result.reset = supervisor.step(now);
+        if (result.reset != nullptr)
+        {
+            result.resetAt = now;
+            break;
+        }
+    }
+    return result;
+}
+
+// Start over at boot, with the given number of resets since power on
+void boot(Supervisor &supervisor, uint32_t boots)
+{
+    now = 0;
+    for (Fault &fault : faults)
+    {
+        fault = Fault();
+    }
+    supervisor.begin(now, boots);
+}
+
+// WiFi drops and comes back with a reconnect, or with a restart of the driver
+void test_wifi_recovers()
+{
+    Supervisor supervisor(components, 3);
+    boot(supervisor, 0);
+    run(supervisor, 5000);
+    faults[WIFI].down = true;
+    faults[WIFI].fixedBy = 0;
+    Run result = run(supervisor, 3600000);
+    CHECK(result.reset == nullptr);
+    CHECK_EQ(faults[WIFI].times.size(), 1);
+    CHECK_EQ(faults[WIFI].times[0], 4000 + 60000);
+
+    boot(supervisor, 0);
+    run(supervisor, 5000);
+    faults[WIFI].down = true;
+    faults[WIFI].fixedBy = 1;
+    result = run(supervisor, 3600000);
+    CHECK(result.reset == nullptr);
+    CHECK_EQ(faults[WIFI].steps.size(), 2);
+    CHECK_EQ(faults[WIFI].times[1], 4000 + 120000);
+    CHECK_EQ(supervisor.stepsTaken(WIFI), 0);
+}
+
+// A stuck driver gets a reset after three minutes, and later each reset since power on doubles the wait
+void test_wifi_stuck()
+{
+    Supervisor supervisor(components, 3);
+    unsigned long expected[] = {180000, 360000, 720000, 1440000, 2880000, 5760000, 5760000};
+    for (uint32_t boots = 0; boots < 7; boots++)
+    {
+        boot(supervisor, boots);
+        faults[WIFI].down = true;
+        faults[WIFI].internal = true;
+        Run result = run(supervisor, 24 * 3600000UL);
+        CHECK(result.reset == &components[WIFI]);
+        CHECK_EQ(result.resetAt, expected[boots]);
+        printf("wifi stuck after %u resets: reset after %lu s, %zu recovery steps\n", boots, result.resetAt / 1000,
+               faults[WIFI].steps.size());
+        // Reconnect, restart, then restarts until the reset
+        CHECK_EQ(faults[WIFI].steps[0], 0);
+        CHECK_EQ(faults[WIFI].steps[1], 1);
+        CHECK_EQ(faults[WIFI].steps.back(), 1);
+    }
+}
+
+// An access point that is gone, or a broker that is down, is not cured by a reset: retries back off instead
+void test_external_faults()
+{
+    Supervisor supervisor(components, 3);
+    boot(supervisor, 0);
+    faults[WIFI].down = true;
+    faults[MQTT].down = true;
+    Run result = run(supervisor, 24 * 3600000UL);
+    CHECK(result.reset == nullptr);
+
+    for (int c : {WIFI, MQTT})
+    {
+        const std::vector<unsigned long> &times = faults[c].times;
+        unsigned long longest = 0;
+        for (size_t i = 1; i < times.size(); i++)
+        {
+            CHECK(times[i] - times[i - 1] >= (i > 1 ? times[i - 1] - times[i - 2] : 0));
+            longest = times[i] - times[i - 1] > longest ? times[i] - times[i - 1] : longest;
+        }
+        printf("%s down for a day: %zu recovery steps, at most %lu s apart\n", components[c].name, times.size(),
+               longest / 1000);
+        CHECK(times.size() <= 24 * 3600000UL / SUPERVISOR_MAX_RETRY_MS + 10);
+        CHECK_EQ(longest, SUPERVISOR_MAX_RETRY_MS);
+    }
+
+    // Once the network is back, WiFi is recovered by the next retry
+    faults[WIFI].fixedBy = 1;
+    unsigned long back = now;
+    run(supervisor, now + SUPERVISOR_MAX_RETRY_MS + 1000);
+    CHECK(!faults[WIFI].down);
+    CHECK(faults[WIFI].times.back() - back <= SUPERVISOR_MAX_RETRY_MS);
+}
+
+// A fault that only looks internal now and then never resets the board, one has to look it for a whole
+// timeout in a row
+void test_transient_status()
+{
+    Supervisor supervisor(components, 3);
+    boot(supervisor, 0);
+    faults[WIFI].down = true;
+    faults[WIFI].internal = true;
+    faults[WIFI].flickers = true;
+    Run result = run(supervisor, 24 * 3600000UL);
+    CHECK(result.reset == nullptr);
+
+    faults[WIFI].flickers = false;
+    unsigned long steady = now;
+    result = run(supervisor, 24 * 3600000UL + 3600000);
+    CHECK(result.reset == &components[WIFI]);
+    CHECK_EQ(result.resetAt, steady + WIFI_TIMEOUT_MS);
+
+    // Looking external once starts the wait over
+    boot(supervisor, 0);
+    faults[WIFI].down = true;
+    faults[WIFI].internal = true;
+    run(supervisor, 170000);
+    faults[WIFI].internal = false;
+    run(supervisor, 171000);
+    faults[WIFI].internal = true;
+    result = run(supervisor, 3600000);
+    CHECK_EQ(result.resetAt, 171000 + WIFI_TIMEOUT_MS);
+}
+
+// A missing display is tried again and again, less and less often, without a reset
+void test_display_missing()
+{
+    Supervisor supervisor(components, 3);
+    boot(supervisor, 0);
+    faults[DISPLAY].down = true;
+    Run result = run(supervisor, 3600000);
+    CHECK(result.reset == nullptr);
+    const std::vector<unsigned long> &times = faults[DISPLAY].times;
+    CHECK_EQ(times[0], 10000);
+    CHECK_EQ(times[1], 20000);
+    CHECK_EQ(times[2], 40000);
+    CHECK(times.size() < 15);
+
+    // Plugged back in, it is found by the next try
+    faults[DISPLAY].fixedBy = 0;
+    run(supervisor, now + SUPERVISOR_MAX_RETRY_MS + 1000);
+    CHECK(!faults[DISPLAY].down);
+}
+
+// loop() stalled for 25 s, under the watchdog: the recovery steps due meanwhile are taken one at a time
+void test_hang()
+{
+    Supervisor supervisor(components, 3);
+    boot(supervisor, 0);
+    faults[WIFI].down = true;
+    faults[WIFI].internal = true;
+    Run result = run(supervisor, 24 * 3600000UL, 50000, 25000);
+    CHECK(result.reset == &components[WIFI]);
+    CHECK_EQ(faults[WIFI].times[0], 75000);
+    CHECK_EQ(faults[WIFI].times[1], 75000 + 60000);
+    CHECK_EQ(result.resetAt, 180000);
+}
+
+// A fault that clears halfway through starts from the first step the next time
+void test_escalation_restarts()
+{
+    Supervisor supervisor(components, 3);
+    boot(supervisor, 0);
+    faults[WIFI].down = true;
+    run(supervisor, 70000);
+    CHECK_EQ(supervisor.stepsTaken(WIFI), 1);
+    faults[WIFI].down = false;
+    run(supervisor, 80000);
+    CHECK_EQ(supervisor.stepsTaken(WIFI), 0);
+
+    // Last seen healthy one period before
+    faults[WIFI].down = true;
+    faults[WIFI].internal = true;
+    Run result = run(supervisor, 24 * 3600000UL);
+    CHECK_EQ(faults[WIFI].times[1], 79000 + 60000);
+    CHECK_EQ(faults[WIFI].steps[1], 0);
+    CHECK_EQ(result.resetAt, 79000 + 180000);
+}
+
+int main()
+{
+    test_wifi_recovers();
+    test_wifi_stuck();
+    test_external_faults();
+    test_transient_status();
+    test_display_missing();
+    test_hang();
+    test_escalation_restarts();
+    return check_result("test_supervisor");
+}
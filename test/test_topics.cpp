@@ -0,0 +1,33 @@
+// Device identity and the topics a box listens on
+#include "check.h"
+
+#include "topics.h"
+
+void test_identity()
+{
+    char deviceId[DEVICE_ID_SIZE];
+    char clientId[24];
+    // ESP.getEfuseMac() returns the first byte of the address lowest
+    formatDeviceId(deviceId, 0x563412c40a24ULL);
+    CHECK(strcmp(deviceId, "240ac4123456") == 0);
+    formatClientId(clientId, sizeof(clientId), deviceId);
+    CHECK(strcmp(clientId, "medibox-240ac4123456") == 0);
+}
+
+void test_topics()
+{
+    char topic[64];
+    CHECK(strcmp(formatTopic(topic, sizeof(topic), "240ac4123456", "temp"), "medibox/240ac4123456/temp") == 0);
+    CHECK(strcmp(formatTopic(topic, sizeof(topic), "240ac4123456", "cmd/#"), "medibox/240ac4123456/cmd/#") == 0);
+
+    CHECK(strcmp(topicCommand("medibox/240ac4123456/cmd/alarm"), "alarm") == 0);
+    CHECK(strcmp(topicCommand("medibox/all/cmd/ota"), "ota") == 0);
+    CHECK(topicCommand("medibox/240ac4123456/temp") == nullptr);
+}
+
+int main()
+{
+    test_identity();
+    test_topics();
+    return check_result("test_topics");
+}
@@ -0,0 +1,26 @@
+// Commands the local status page may send
+#include "check.h"
+
+#include "web_commands.h"
+
+void test_allowlist()
+{
+    // The controls on the page
+    CHECK(webCommandAllowed("on-off"));
+    CHECK(webCommandAllowed("drop-down"));
+    CHECK(webCommandAllowed("low-power"));
+
+    // Firmware, tracing and the dose log only come through MQTT
+    CHECK(!webCommandAllowed("ota"));
+    CHECK(!webCommandAllowed("trace"));
+    CHECK(!webCommandAllowed("dose-sync"));
+    CHECK(!webCommandAllowed("profile-upload"));
+    CHECK(!webCommandAllowed(""));
+    CHECK(!webCommandAllowed("on-off "));
+}
+
+int main()
+{
+    test_allowlist();
+    return check_result("test_web_commands");
+}
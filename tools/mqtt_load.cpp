@@ -0,0 +1,517 @@
+// Load test for the broker and the dashboard: a fleet of simulated boxes and one controller
+//
+// Every simulated box connects like the firmware does (same client id, topics, last will, persistent
+// session and QoS 1 subscriptions, from topics.h) and publishes its readings at a fixed rate. The
+// controller subscribes to the readings like the dashboard, and sends a ping to the whole fleet and to
+// one box at a time with QoS 1 like the dashboard's commands, which measures how long a command takes
+// to reach every box.
+//
+// Usage: mqtt_load [-h host] [-p port] [-n boxes] [-r readings per second] [-d seconds] [-b pings per second]
+#include "topics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define KEEP_ALIVE_S 60
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Just enough of MQTT 3.1.1 for the firmware's traffic: QoS 0 readings, QoS 1 commands and subscriptions
+class MqttConnection
+{
+public:
+    int fd = -1;
+    bool connected = false; // CONNACK received
+    std::string out;        // Bytes waiting for the socket
+    std::string in;
+
+    bool open(const char *host, int port)
+    {
+        struct addrinfo hints = {}, *res;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        char service[8];
+        snprintf(service, sizeof(service), "%d", port);
+        if (getaddrinfo(host, service, &hints, &res) != 0)
+        {
+            return false;
+        }
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        bool ok = fd >= 0 && ::connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+        freeaddrinfo(res);
+        if (!ok)
+        {
+            return false;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return true;
+    }
+
+    // Without a clean session the broker keeps the subscriptions, and queues QoS 1 messages while offline
+    void connect(const char *clientId, const char *willTopic, const char *willMessage, bool cleanSession)
+    {
+        std::string body;
+        body += std::string("\0\4MQTT\4", 7);
+        body += (char)((cleanSession ? 0x02 : 0) | 0x04 | 0x08 | 0x20); // Retained QoS 1 will
+        body += (char)(KEEP_ALIVE_S >> 8);
+        body += (char)(KEEP_ALIVE_S & 0xff);
+        body += string(clientId);
+        body += string(willTopic);
+        body += string(willMessage);
+        packet(0x10, body);
+    }
+
+    void subscribe(const char *filter)
+    {
+        std::string body;
+        body += (char)(nextId >> 8);
+        body += (char)(nextId & 0xff);
+        nextId++;
+        body += string(filter);
+        body += (char)1;
+        packet(0x82, body);
+    }
+
+    void publish(const char *topic, const std::string &payload, bool retain = false, int qos = 0)
+    {
+        std::string body = string(topic);
+        if (qos > 0)
+        {
+            // The broker's PUBACK is not waited for
+            body += (char)(nextId >> 8);
+            body += (char)(nextId & 0xff);
+            nextId++;
+        }
+        packet(0x30 | qos << 1 | (retain ? 1 : 0), body + payload);
+        published++;
+    }
+
+    // Keep the connection open while there is nothing else to send
+    void keepAlive(uint64_t now)
+    {
+        if (now - lastSent > KEEP_ALIVE_S * 1000000ULL / 2)
+        {
+            packet(0xc0, "");
+        }
+    }
+
+    void disconnect()
+    {
+        packet(0xe0, "");
+    }
+
+    // Send what the socket takes, false once it is closed
+    bool flush()
+    {
+        while (!out.empty())
+        {
+            ssize_t n = ::write(fd, out.data(), out.size());
+            if (n < 0)
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            out.erase(0, n);
+        }
+        return true;
+    }
+
+    // Read what arrived and hand each publish to the callback, false once the socket is closed
+    template <typename Callback>
+    bool receive(Callback onPublish)
+    {
+        char buf[16384];
+        for (;;)
+        {
+            ssize_t n = ::read(fd, buf, sizeof(buf));
+            if (n == 0)
+            {
+                return false;
+            }
+            if (n < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    return false;
+                }
+                break;
+            }
+            in.append(buf, n);
+        }
+
+        for (;;)
+        {
+            // Fixed header: type and flags, then the remaining length in 7 bit groups
+            size_t length = 0, pos = 1;
+            int shift = 0;
+            for (;;)
+            {
+                if (pos >= in.size())
+                {
+                    return true;
+                }
+                uint8_t b = in[pos++];
+                length |= (size_t)(b & 0x7f) << shift;
+                shift += 7;
+                if ((b & 0x80) == 0)
+                {
+                    break;
+                }
+            }
+            if (in.size() < pos + length)
+            {
+                return true;
+            }
+
+            uint8_t type = in[0];
+            const char *body = in.data() + pos;
+            if ((type & 0xf0) == 0x20)
+            {
+                connected = true;
+            }
+            else if ((type & 0xf0) == 0x30)
+            {
+                size_t topicLength = ((uint8_t)body[0] << 8) | (uint8_t)body[1];
+                std::string topic(body + 2, topicLength);
+                size_t start = 2 + topicLength;
+                int qos = (type >> 1) & 3;
+                if (qos > 0)
+                {
+                    // Acknowledge with the packet id
+                    packet(0x40, std::string(body + start, 2));
+                    start += 2;
+                }
+                onPublish(topic, std::string(body + start, length - start));
+            }
+            in.erase(0, pos + length);
+        }
+    }
+
+    size_t published = 0;
+
+private:
+    static std::string string(const char *s)
+    {
+        size_t n = strlen(s);
+        return std::string(1, (char)(n >> 8)) + (char)(n & 0xff) + s;
+    }
+
+    void packet(uint8_t type, const std::string &body)
+    {
+        lastSent = nowUs();
+        out += (char)type;
+        size_t length = body.size();
+        do
+        {
+            uint8_t b = length & 0x7f;
+            length >>= 7;
+            out += (char)(b | (length > 0 ? 0x80 : 0));
+        } while (length > 0);
+        out += body;
+    }
+
+    uint16_t nextId = 1;
+    uint64_t lastSent = 0;
+};
+
+struct Box
+{
+    MqttConnection mqtt;
+    char deviceId[DEVICE_ID_SIZE];
+    char clientId[24];
+    char topics[4][64]; // status, temp, light-intensity, motor-ang
+    uint64_t nextReading = 0;
+};
+
+static double percentile(std::vector<double> &values, double p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: mqtt_load [-h host] [-p port] [-n boxes] [-r readings per second] [-d seconds] "
+                    "[-b pings per second]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = "127.0.0.1";
+    int port = 1883;
+    int boxes = 200;
+    double rate = 1;
+    double duration = 30;
+    double pingRate = 2;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:n:r:d:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'n': boxes = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'b': pingRate = atof(optarg); break;
+        default: usage();
+        }
+    }
+    if (boxes <= 0 || rate <= 0 || duration <= 0 || pingRate <= 0)
+    {
+        usage();
+    }
+
+    // The fleet, with made up MAC addresses
+    std::vector<Box> fleet(boxes);
+    uint64_t start = nowUs();
+    uint64_t runStart = UINT64_MAX;
+    for (int i = 0; i < boxes; i++)
+    {
+        Box &box = fleet[i];
+        formatDeviceId(box.deviceId, 0xfe0000c40a24ULL + ((uint64_t)i << 24));
+        formatClientId(box.clientId, sizeof(box.clientId), box.deviceId);
+        const char *names[] = {"status", "temp", "light-intensity", "motor-ang"};
+        for (int t = 0; t < 4; t++)
+        {
+            formatTopic(box.topics[t], sizeof(box.topics[t]), box.deviceId, names[t]);
+        }
+        if (!box.mqtt.open(host, port))
+        {
+            fprintf(stderr, "box %d: cannot connect to %s:%d: %s\n", i, host, port, strerror(errno));
+            return 1;
+        }
+        char filter[64];
+        box.mqtt.connect(box.clientId, box.topics[0], "offline", false);
+        box.mqtt.subscribe(formatTopic(filter, sizeof(filter), box.deviceId, "cmd/#"));
+        box.mqtt.subscribe(TOPIC_ROOT "/" GROUP_ID "/cmd/#");
+        box.mqtt.publish(box.topics[0], "online", true);
+    }
+
+    // The dashboard
+    MqttConnection controller;
+    if (!controller.open(host, port))
+    {
+        fprintf(stderr, "controller: cannot connect to %s:%d\n", host, port);
+        return 1;
+    }
+    controller.connect("medibox-load-controller", TOPIC_ROOT "/load-controller/status", "offline", true);
+    controller.subscribe(TOPIC_ROOT "/+/temp");
+
+    // Wait for every CONNACK
+    std::vector<struct pollfd> fds(boxes + 1);
+    auto pollOnce = [&](int timeoutMs, std::vector<double> *fanout, std::vector<double> *direct,
+                        size_t *readings, size_t *readingBytes) {
+        for (int i = 0; i <= boxes; i++)
+        {
+            MqttConnection &c = i < boxes ? fleet[i].mqtt : controller;
+            fds[i].fd = c.fd;
+            fds[i].events = POLLIN | (c.out.empty() ? 0 : POLLOUT);
+        }
+        poll(fds.data(), fds.size(), timeoutMs);
+        uint64_t now = nowUs();
+        for (int i = 0; i <= boxes; i++)
+        {
+            MqttConnection &c = i < boxes ? fleet[i].mqtt : controller;
+            bool alive = c.flush() && c.receive([&](const std::string &topic, const std::string &payload) {
+                if (i == boxes)
+                {
+                    if (readings != nullptr)
+                    {
+                        (*readings)++;
+                        *readingBytes += payload.size();
+                    }
+                    return;
+                }
+                // Ping payload: send time in microseconds
+                // Pings queued in the box's session by an earlier run are left out
+                uint64_t sent = strtoull(payload.c_str(), nullptr, 10);
+                if (sent < runStart)
+                {
+                    return;
+                }
+                double latency = (now - sent) / 1000.0;
+                if (fanout != nullptr && topic.find("/" GROUP_ID "/cmd/") != std::string::npos)
+                {
+                    fanout->push_back(latency);
+                }
+                else if (direct != nullptr)
+                {
+                    direct->push_back(latency);
+                }
+            });
+            if (!alive)
+            {
+                fprintf(stderr, "%s closed the connection\n", i < boxes ? fleet[i].clientId : "controller");
+                exit(1);
+            }
+        }
+    };
+
+    auto waitConnected = [&](uint64_t timeoutUs) {
+        uint64_t waitStart = nowUs();
+        for (;;)
+        {
+            int ready = controller.connected;
+            for (const Box &box : fleet)
+            {
+                ready += box.mqtt.connected;
+            }
+            if (ready == boxes + 1)
+            {
+                return true;
+            }
+            if (nowUs() - waitStart > timeoutUs)
+            {
+                fprintf(stderr, "only %d of %d connections accepted\n", ready, boxes + 1);
+                return false;
+            }
+            pollOnce(10, nullptr, nullptr, nullptr, nullptr);
+        }
+    };
+    if (!waitConnected(30000000ULL))
+    {
+        return 1;
+    }
+    double connectMs = (nowUs() - start) / 1000.0;
+
+    // Run: readings from every box, pings from the controller
+    std::vector<double> fanout, direct;
+    size_t readings = 0, readingBytes = 0, pings = 0, directPings = 0;
+    runStart = nowUs();
+    uint64_t runEnd = runStart + (uint64_t)(duration * 1e6);
+    uint64_t nextPing = runStart;
+    uint64_t period = (uint64_t)(1e6 / rate);
+    for (int i = 0; i < boxes; i++)
+    {
+        // Spread the readings over the period
+        fleet[i].nextReading = runStart + period * i / boxes;
+    }
+    size_t publishedBefore = 0;
+    for (const Box &box : fleet)
+    {
+        publishedBefore += box.mqtt.published;
+    }
+
+    while (nowUs() < runEnd)
+    {
+        uint64_t now = nowUs();
+        for (Box &box : fleet)
+        {
+            if (now >= box.nextReading)
+            {
+                box.nextReading += period;
+                char value[16];
+                snprintf(value, sizeof(value), "%.2f", 20 + rand() % 1500 / 100.0);
+                box.mqtt.publish(box.topics[1], value);
+                box.mqtt.publish(box.topics[2], "{\"LDR\":\"Right LED\",\"Intensity\":\"0.42\"}");
+                box.mqtt.publish(box.topics[3], "-27");
+            }
+            box.mqtt.keepAlive(now);
+        }
+        controller.keepAlive(now);
+        if (now >= nextPing)
+        {
+            // Alternate between the whole fleet and a single box
+            nextPing += (uint64_t)(1e6 / pingRate);
+            std::string payload = std::to_string(nowUs());
+            char topic[64];
+            if (pings % 2 == 0)
+            {
+                controller.publish(TOPIC_ROOT "/" GROUP_ID "/cmd/load-ping", payload, false, 1);
+            }
+            else
+            {
+                controller.publish(formatTopic(topic, sizeof(topic), fleet[rand() % boxes].deviceId, "cmd/load-ping"),
+                                   payload, false, 1);
+                directPings++;
+            }
+            pings++;
+        }
+        pollOnce(1, &fanout, &direct, &readings, &readingBytes);
+    }
+
+    // Let the last pings arrive
+    uint64_t drainEnd = nowUs() + 2000000;
+    while (nowUs() < drainEnd)
+    {
+        pollOnce(10, &fanout, &direct, nullptr, nullptr);
+    }
+    double seconds = (nowUs() - runStart - 2000000) / 1e6;
+
+    size_t published = 0;
+    for (const Box &box : fleet)
+    {
+        published += box.mqtt.published;
+    }
+    published -= publishedBefore;
+    size_t broadcasts = pings - directPings;
+
+    printf("boxes                %d\n", boxes);
+    printf("connect all          %.0f ms\n", connectMs);
+    printf("publish rate         %.0f msg/s (%zu messages)\n", published / seconds, published);
+    printf("dashboard throughput %.0f msg/s, %.1f kB/s of temperature readings (%zu of %zu)\n",
+           readings / seconds, readingBytes / seconds / 1000, readings, published / 3);
+    printf("fleet pings          %zu, delivered %.1f%%\n", broadcasts,
+           broadcasts > 0 ? 100.0 * fanout.size() / (broadcasts * boxes) : 0);
+    printf("fan-out latency      p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", percentile(fanout, 0.5),
+           percentile(fanout, 0.9), percentile(fanout, 0.99), percentile(fanout, 1));
+    printf("box pings            %zu, delivered %.1f%%\n", directPings,
+           directPings > 0 ? 100.0 * direct.size() / directPings : 0);
+    printf("box ping latency     p50 %.2f ms, p99 %.2f ms\n", percentile(direct, 0.5), percentile(direct, 0.99));
+
+    // Leave no retained state or sessions behind: connecting again with a clean session drops the one
+    // each box kept
+    for (Box &box : fleet)
+    {
+        box.mqtt.publish(box.topics[0], "", true);
+        box.mqtt.disconnect();
+        box.mqtt.flush();
+        close(box.mqtt.fd);
+        box.mqtt = MqttConnection();
+        if (!box.mqtt.open(host, port))
+        {
+            fprintf(stderr, "%s: cannot connect again to drop its session\n", box.clientId);
+            return 1;
+        }
+        box.mqtt.connect(box.clientId, box.topics[0], "offline", true);
+    }
+    waitConnected(5000000ULL);
+    for (Box &box : fleet)
+    {
+        box.mqtt.disconnect();
+        box.mqtt.flush();
+        close(box.mqtt.fd);
+    }
+    controller.disconnect();
+    controller.flush();
+    close(controller.fd);
+    return 0;
+}
@@ -0,0 +1,449 @@
+// Replay of a recorded trace on the host, through the firmware's own input layer, alarms and menu
+//
+// Feeds the trace (see inputs.h) to inputs.h, alarms.h and menu.h on a virtual clock that jumps from
+// deadline to deadline like the esp32-replay build does, and prints what the box did, one event per
+// line: alarms ringing, dose outcomes, adherence, menu screens and the commands received. The dose log
+// is kept in memory, and the display, buzzer, servo and network are left out.
+//
+// With -e the events are compared against an expected outcome file, and any difference fails the run,
+// so traces of field bugs can be kept as regression tests (see test/traces).
+//
+// Usage: replay [-a HH:MM,...] [-z utc-offset-seconds] [-e expected] trace
+// The trace is the binary file, or the hex printed by the trace dump command.
+// The alarms default to the firmware's, and the UTC offset to IST like the firmware.
+#define MEDIBOX_REPLAY
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#define HIGH 1
+#define LOW 0
+
+// Pin Definitions, the buttons as on the board
+#define PB_CANCEL 34
+#define PB_OK 32
+#define PB_UP 33
+#define PB_DOWN 35
+
+struct TempAndHumidity
+{
+    float temperature;
+    float humidity;
+};
+
+#include "inputs.h"
+#include "alarms.h"
+#include "menu.h"
+
+// A trace read whole into memory
+class MemoryTrace : public TraceFile
+{
+public:
+    std::vector<uint8_t> data;
+    size_t position = 0;
+
+    size_t read(uint8_t *buf, size_t size)
+    {
+        size = size < data.size() - position ? size : data.size() - position;
+        memcpy(buf, data.data() + position, size);
+        position += size;
+        return size;
+    }
+
+    size_t write(const uint8_t *buf, size_t size)
+    {
+        return 0;
+    }
+
+    void flush()
+    {
+    }
+};
+
+// Dose log in memory, erased like flash
+class MemoryDoseStorage : public DoseStorage
+{
+public:
+    std::vector<uint8_t> bytes = std::vector<uint8_t>(4 * DOSE_SECTOR_SIZE, 0xFF);
+
+    size_t size()
+    {
+        return bytes.size();
+    }
+
+    bool read(size_t offset, void *buf, size_t size)
+    {
+        memcpy(buf, bytes.data() + offset, size);
+        return true;
+    }
+
+    bool write(size_t offset, const void *buf, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            bytes[offset + i] &= ((const uint8_t *)buf)[i];
+        }
+        return true;
+    }
+
+    bool erase(size_t offset, size_t size)
+    {
+        memset(bytes.data() + offset, 0xFF, size);
+        return true;
+    }
+};
+
+MemoryDoseStorage doseStorage;
+DoseLog doseLog;
+long utcOffset = 19800;
+unsigned long timeLast = 0; // Last clock update
+std::vector<std::string> events;
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Print an event, stamped with the local time once the clock is set and the trace time before
+void event(const char *format, ...)
+{
+    char line[400];
+    struct tm timeinfo;
+    int length;
+    if (inputLocalTime(&timeinfo))
+    {
+        length = strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S ", &timeinfo);
+    }
+    else
+    {
+        length = snprintf(line, sizeof(line), "+%lums ", inputMillis());
+    }
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line + length, sizeof(line) - length, format, args);
+    va_end(args);
+    puts(line);
+    events.push_back(line);
+}
+
+// The includer's side of inputs.h, alarms.h and menu.h
+void handleCommand(const char *command, const char *payload)
+{
+    event("command %s %s", command, payload);
+    if (strcmp(command, "adherence") == 0)
+    {
+        time_t from = local_midnight() - atoi(payload) * 24L * 60 * 60;
+        publishAdherence(from, from + 24 * 60 * 60);
+    }
+}
+
+void show_ring(bool on)
+{
+    if (on)
+    {
+        event("ring alarm %d", ringing + 1);
+    }
+}
+
+void play_note(int frequency)
+{
+}
+
+void logDose(DoseRecord &record)
+{
+    static const char *outcomes[] = {"taken", "snoozed", "missed"};
+    doseLog.append(record);
+    event("dose alarm %d %s after %u s", record.alarm + 1, outcomes[record.outcome], (unsigned)record.latency);
+}
+
+void publishAdherence(time_t from, time_t to)
+{
+    struct tm day;
+    localtime_r(&from, &day);
+    char date[11];
+    strftime(date, sizeof(date), "%Y-%m-%d", &day);
+    char json[128];
+    formatAdherence(json, sizeof(json), date, doseSummary(doseLog, from, to));
+    event("adherence %s", json);
+}
+
+void saveAlarms()
+{
+    char alarms[64] = "";
+    for (int i = 0; i < n_alarms; i++)
+    {
+        snprintf(alarms + strlen(alarms), sizeof(alarms) - strlen(alarms), "%s%02d:%02d", i > 0 ? "," : "",
+                 alarm_hours[i], alarm_minutes[i]);
+    }
+    event("alarms %s %s", alarms, alarm_enabled ? "on" : "off");
+}
+
+void saveTriggered()
+{
+}
+
+// Only called when the menu is left
+void clear_display()
+{
+    event("clock");
+}
+
+void draw_menu_item()
+{
+    const MenuItem &item = menu_items[menu_item];
+    if (item.count > 1)
+    {
+        event("menu %d - %s %d", current_mode + 1, item.label, menu_instance + 1);
+    }
+    else
+    {
+        event("menu %d - %s", current_mode + 1, item.label);
+    }
+}
+
+void draw_field()
+{
+    event("edit %s %d", menu_items[menu_item].fields[menu_field].label, menu_values[menu_field]);
+}
+
+void draw_field_value()
+{
+    event("value %d", menu_values[menu_field]);
+}
+
+void draw_menu_message(const char *message)
+{
+    event("message %s", message);
+}
+
+void load_timezone(int index, int *values)
+{
+    values[0] = utcOffset / 3600;
+    values[1] = labs(utcOffset) / 60 % 60;
+}
+
+void commit_timezone(int index, const int *values)
+{
+    event("timezone %d:%02d", values[0], values[1]);
+}
+
+// The state the next deadline depends on, as the sketch gathers it in a replay
+PowerInputs powerInputs()
+{
+    PowerInputs in = {};
+    in.now = inputMillis();
+    in.clockLast = timeLast;
+    in.clockPeriod = clockPeriod(true, seconds);
+    in.daySeconds = (hours * 60L + minutes) * 60 + seconds;
+    in.epoch = inputClockMs(CLOCK_LOCAL) / 1000;
+    in.alarmsEnabled = alarm_enabled;
+    in.alarms = n_alarms;
+    in.alarmHours = alarm_hours;
+    in.alarmMinutes = alarm_minutes;
+    in.alarmTriggered = alarm_triggered;
+    in.snoozeUntil = snooze_until;
+    in.menuIdle = menu_state == MENU_IDLE;
+    in.menuMessage = menu_state == MENU_MESSAGE;
+    in.menuMessageUntil = menu_message_until;
+    in.buttonSettleLeft = button_settle_left();
+    in.ringing = ringing >= 0;
+    in.ringLeft = ringing >= 0 ? ring_left(in.now) : 0;
+    return in;
+}
+
+// Read a trace, as binary or as the hex of the trace dump command
+bool loadTrace(const char *path, MemoryTrace &trace)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    int c;
+    while ((c = fgetc(file)) != EOF)
+    {
+        trace.data.push_back(c);
+    }
+    fclose(file);
+
+    if (trace.data.size() < 8 || memcmp(trace.data.data(), "4d425431", 8) != 0)
+    {
+        return true;
+    }
+    std::vector<uint8_t> bytes;
+    std::string digits;
+    for (uint8_t c : trace.data)
+    {
+        if (isxdigit(c))
+        {
+            digits += c;
+        }
+        if (digits.size() == 2)
+        {
+            bytes.push_back(strtoul(digits.c_str(), nullptr, 16));
+            digits.clear();
+        }
+    }
+    trace.data = bytes;
+    return true;
+}
+
+// Set the alarms from e.g. 08:00,13:00,20:00, false if malformed
+bool parseAlarms(const char *text)
+{
+    for (int i = 0; i < n_alarms; i++)
+    {
+        int hour, minute, length;
+        if (sscanf(text, "%d:%d%n", &hour, &minute, &length) != 2 || hour < 0 || hour > 23 || minute < 0 ||
+            minute > 59)
+        {
+            return false;
+        }
+        alarm_hours[i] = hour;
+        alarm_minutes[i] = minute;
+        text += length;
+        if (*text == '\0')
+        {
+            return true;
+        }
+        if (*text++ != ',')
+        {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Compare the events against the expected outcome file, reporting the first difference
+bool checkExpected(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "cannot read %s\n", path);
+        return false;
+    }
+    std::vector<std::string> expected;
+    char line[400];
+    while (fgets(line, sizeof(line), file) != nullptr)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#')
+        {
+            expected.push_back(line);
+        }
+    }
+    fclose(file);
+
+    for (size_t i = 0; i < expected.size() || i < events.size(); i++)
+    {
+        const char *want = i < expected.size() ? expected[i].c_str() : "(nothing)";
+        const char *got = i < events.size() ? events[i].c_str() : "(nothing)";
+        if (strcmp(want, got) != 0)
+        {
+            fprintf(stderr, "event %zu differs:\n  expected: %s\n  replayed: %s\n", i + 1, want, got);
+            return false;
+        }
+    }
+    fprintf(stderr, "%zu events as expected\n", events.size());
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: replay [-a HH:MM,...] [-z utc-offset-seconds] [-e expected] trace\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *expected = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:z:e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            if (!parseAlarms(optarg))
+            {
+                usage();
+            }
+            break;
+        case 'z': utcOffset = atol(optarg); break;
+        case 'e': expected = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage();
+    }
+
+    // The same local time as configTime() gives the board, POSIX offsets being west of UTC
+    char tz[32];
+    long offset = labs(utcOffset);
+    snprintf(tz, sizeof(tz), "UTC%c%02ld:%02ld", utcOffset < 0 ? '+' : '-', offset / 3600, offset / 60 % 60);
+    setenv("TZ", tz, 1);
+    tzset();
+
+    MemoryTrace trace;
+    if (!loadTrace(argv[optind], trace))
+    {
+        fprintf(stderr, "cannot read %s\n", argv[optind]);
+        return 2;
+    }
+    resetInputs();
+    if (!replayBegin(&trace))
+    {
+        fprintf(stderr, "%s is not a trace\n", argv[optind]);
+        return 2;
+    }
+    doseLog.begin(&doseStorage);
+
+    // loop() as a replay build runs it, without the network, display and sensors
+    // The first pass updates the clock, as setLowPowerMode() has it do on the board
+    timeLast = inputMillis() - UPDATE_PERIOD_LOW_POWER_MS;
+    uint64_t start = nowUs();
+    unsigned long passes = 0;
+    do
+    {
+        passes++;
+        int pressed = read_button();
+        if (ringing >= 0)
+        {
+            ring_step(pressed);
+        }
+        else
+        {
+            menu_step(pressed);
+        }
+
+        if (clockDue(powerInputs()))
+        {
+            timeLast = inputMillis();
+            update_time();
+            check_alarms();
+        }
+    } while (replayJump(nextDeadline(powerInputs())));
+
+    double elapsed = (nowUs() - start) / 1e6;
+    fprintf(stderr, "replayed %.1f h of trace in %.3f s, %lu passes of loop()\n", replayNow / 3600e3, elapsed,
+            passes);
+    if (expected != nullptr && !checkExpected(expected))
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,399 @@
+// Benchmark for the local status page's WebSocket on a running box
+//
+// Opens 1, 2, 4, ... clients up to the given count. For each count, one client sends a command and
+// the time until each client gets the state push that follows is measured. The tool also counts the
+// clients the box dropped, and checks that a command outside the allowlist (web_commands.h) is refused.
+//
+// Usage: ws_bench -h box-ip [-p port] [-c clients] [-n commands per count]
+#include "web_commands.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define RESPONSE_TIMEOUT_MS 3000
+
+// Turning the buzzer off is harmless and always answered with a state push
+#define BENCH_COMMAND "{\"cmd\":\"on-off\",\"payload\":\"0\"}"
+#define REFUSED_COMMAND "{\"cmd\":\"ota\",\"payload\":\"{}\"}"
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Just enough of RFC 6455 for the status page: masked text frames out, text, ping and close in
+class WebSocketClient
+{
+public:
+    int fd = -1;
+    bool open = false;
+    std::vector<std::string> messages; // Text messages received, oldest first
+
+    bool connect(const char *host, int port)
+    {
+        struct addrinfo hints = {}, *res;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        char service[8];
+        snprintf(service, sizeof(service), "%d", port);
+        if (getaddrinfo(host, service, &hints, &res) != 0)
+        {
+            return false;
+        }
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        bool ok = fd >= 0 && ::connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+        freeaddrinfo(res);
+        if (!ok)
+        {
+            return false;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::string request = std::string("GET /ws HTTP/1.1\r\nHost: ") + host +
+                              "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+        if (::write(fd, request.data(), request.size()) != (ssize_t)request.size())
+        {
+            return false;
+        }
+
+        // The response headers, blocking: the frames that follow are read with poll()
+        std::string response;
+        char c;
+        while (response.find("\r\n\r\n") == std::string::npos)
+        {
+            if (::read(fd, &c, 1) != 1)
+            {
+                return false;
+            }
+            response += c;
+        }
+        if (response.compare(0, 12, "HTTP/1.1 101") != 0)
+        {
+            return false;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        open = true;
+        return true;
+    }
+
+    void send(const std::string &text, uint8_t opcode = 0x1)
+    {
+        std::string frame;
+        frame += (char)(0x80 | opcode);
+        if (text.size() < 126)
+        {
+            frame += (char)(0x80 | text.size());
+        }
+        else
+        {
+            frame += (char)(0x80 | 126);
+            frame += (char)(text.size() >> 8);
+            frame += (char)(text.size() & 0xff);
+        }
+        uint8_t mask[4] = {(uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand()};
+        frame.append((const char *)mask, 4);
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            frame += (char)(text[i] ^ mask[i % 4]);
+        }
+        // Small frames on an idle socket, they fit in the send buffer
+        if (::write(fd, frame.data(), frame.size()) != (ssize_t)frame.size())
+        {
+            open = false;
+        }
+    }
+
+    // Read what arrived, false once the box closed the connection
+    bool receive()
+    {
+        char buf[4096];
+        for (;;)
+        {
+            ssize_t n = ::read(fd, buf, sizeof(buf));
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                open = false;
+                return false;
+            }
+            if (n < 0)
+            {
+                break;
+            }
+            in.append(buf, n);
+        }
+
+        for (;;)
+        {
+            if (in.size() < 2)
+            {
+                return true;
+            }
+            uint8_t opcode = in[0] & 0x0f;
+            size_t length = in[1] & 0x7f;
+            size_t pos = 2;
+            if (length == 126)
+            {
+                if (in.size() < 4)
+                {
+                    return true;
+                }
+                length = ((uint8_t)in[2] << 8) | (uint8_t)in[3];
+                pos = 4;
+            }
+            else if (length == 127)
+            {
+                // Never sent by the box, the state is far smaller
+                open = false;
+                return false;
+            }
+            if (in.size() < pos + length)
+            {
+                return true;
+            }
+
+            std::string payload = in.substr(pos, length);
+            in.erase(0, pos + length);
+            if (opcode == 0x1)
+            {
+                messages.push_back(payload);
+            }
+            else if (opcode == 0x9)
+            {
+                send(payload, 0xa);
+            }
+            else if (opcode == 0x8)
+            {
+                open = false;
+                return false;
+            }
+        }
+    }
+
+    void close()
+    {
+        if (open)
+        {
+            send("", 0x8);
+        }
+        ::close(fd);
+        open = false;
+    }
+
+private:
+    std::string in;
+};
+
+// Wait for data on any client, and read it
+static void pollOnce(std::vector<WebSocketClient> &clients, int timeoutMs)
+{
+    std::vector<struct pollfd> fds(clients.size());
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        fds[i].fd = clients[i].open ? clients[i].fd : -1;
+        fds[i].events = POLLIN;
+    }
+    poll(fds.data(), fds.size(), timeoutMs);
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        if (clients[i].open && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            clients[i].receive();
+        }
+    }
+}
+
+// Read from every client for the given time, or until every open client has a message
+static void pollClients(std::vector<WebSocketClient> &clients, int timeoutMs, bool untilAllHaveMessages)
+{
+    uint64_t end = nowUs() + timeoutMs * 1000ULL;
+    for (;;)
+    {
+        bool done = untilAllHaveMessages;
+        for (const WebSocketClient &client : clients)
+        {
+            done = done && (!client.open || !client.messages.empty());
+        }
+        uint64_t now = nowUs();
+        if (done || now >= end)
+        {
+            return;
+        }
+        pollOnce(clients, (int)((end - now + 999) / 1000));
+    }
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: ws_bench -h box-ip [-p port] [-c clients] [-n commands per count]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = nullptr;
+    int port = 80;
+    int maxClients = 16;
+    int commands = 20;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': maxClients = atoi(optarg); break;
+        case 'n': commands = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (host == nullptr || maxClients <= 0 || commands <= 0)
+    {
+        usage();
+    }
+
+    // A command outside the allowlist has to be refused, and one on it carried out
+    bool allowlistOk = !webCommandAllowed("ota") && webCommandAllowed("on-off");
+    {
+        std::vector<WebSocketClient> clients(1);
+        if (!clients[0].connect(host, port))
+        {
+            fprintf(stderr, "cannot open ws://%s:%d/ws\n", host, port);
+            return 1;
+        }
+        pollClients(clients, 500, false);
+        clients[0].messages.clear();
+        clients[0].send(REFUSED_COMMAND);
+        uint64_t end = nowUs() + RESPONSE_TIMEOUT_MS * 1000ULL;
+        bool refused = false;
+        while (!refused && nowUs() < end && clients[0].open)
+        {
+            pollClients(clients, RESPONSE_TIMEOUT_MS, true);
+            for (const std::string &message : clients[0].messages)
+            {
+                refused = refused || message == WEB_ERROR_NOT_ALLOWED;
+            }
+            clients[0].messages.clear();
+        }
+        printf("ota over the WebSocket %s\n", refused ? "refused" : "NOT refused");
+        allowlistOk = allowlistOk && refused;
+        clients[0].close();
+    }
+
+    printf("%8s %8s %12s %12s %12s %14s %10s\n", "clients", "open", "first p50", "all p50", "all p99",
+           "pushes/s each", "answered");
+    for (int count = 1;; count = std::min(count * 2, maxClients))
+    {
+        std::vector<WebSocketClient> clients(count);
+        for (WebSocketClient &client : clients)
+        {
+            client.connect(host, port);
+        }
+
+        // The periodic push, with no commands
+        pollClients(clients, 500, false);
+        for (WebSocketClient &client : clients)
+        {
+            client.messages.clear();
+        }
+        uint64_t idleStart = nowUs();
+        pollClients(clients, 3000, false);
+        double idleSeconds = (nowUs() - idleStart) / 1e6;
+        size_t pushes = 0;
+        int open = 0;
+        for (WebSocketClient &client : clients)
+        {
+            pushes += client.messages.size();
+            open += client.open;
+        }
+
+        // Latency from a command to the push that answers it, on the first client and on all of them
+        // The periodic push can come first once in a while, which only shortens the odd sample
+        std::vector<double> first, all;
+        int answered = 0;
+        for (int i = 0; i < commands; i++)
+        {
+            WebSocketClient *sender = nullptr;
+            for (WebSocketClient &client : clients)
+            {
+                client.messages.clear();
+                sender = sender == nullptr && client.open ? &client : sender;
+            }
+            if (sender == nullptr)
+            {
+                break;
+            }
+            uint64_t sent = nowUs();
+            sender->send(BENCH_COMMAND);
+
+            uint64_t end = sent + RESPONSE_TIMEOUT_MS * 1000ULL;
+            double firstMs = -1;
+            while (nowUs() < end)
+            {
+                pollOnce(clients, (int)((end - nowUs() + 999) / 1000));
+                double ms = (nowUs() - sent) / 1000.0;
+                int waiting = 0, got = 0;
+                for (const WebSocketClient &client : clients)
+                {
+                    waiting += client.open && client.messages.empty();
+                    got += !client.messages.empty();
+                }
+                if (firstMs < 0 && got > 0)
+                {
+                    firstMs = ms;
+                    first.push_back(ms);
+                }
+                if (waiting == 0)
+                {
+                    all.push_back(ms);
+                    answered++;
+                    break;
+                }
+            }
+            // Give the box a moment before the next command
+            pollClients(clients, 100, false);
+        }
+
+        printf("%8d %8d %9.1f ms %9.1f ms %9.1f ms %14.1f %6d/%d\n", count, open, percentile(first, 0.5),
+               percentile(all, 0.5), percentile(all, 0.99), pushes / idleSeconds / std::max(open, 1), answered,
+               commands);
+
+        for (WebSocketClient &client : clients)
+        {
+            client.close();
+        }
+        if (count == maxClients)
+        {
+            break;
+        }
+    }
+    return allowlistOk ? 0 : 1;
+}